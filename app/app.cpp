@@ -10,11 +10,12 @@
 #include <iostream>
 #include <random>
 #include <iomanip>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include <particle/Framework.h>
-
-#define WIDTH 1001
-#define HEIGHT 401
+#include <particle/scenario.h>
 
 void print_fps(int fps) {
   static int sum = 0;
@@ -30,13 +31,33 @@ void print_fps(int fps) {
             << ", avg: " << sum / count << ")\r" << std::flush;
 }
 
+// usage: app [scenario.toml] [section.key=value ...]
 int main(int argc, char **argv) {
   SDL_SetMainReady();
 
-  BoidsSimulation<Space2D> simulation(100, {WIDTH - 1, HEIGHT - 1, 15}, 16);
+  const std::vector<std::string> arguments(argv + 1, argv + argc);
+  Scenario scenario;
+  scenario.num_boids = 100;
+  scenario.width = 1000;
+  scenario.height = 400;
+  scenario.grid_size = 15;
+  scenario.num_threads = 16;
+  // frame times are fed in as they are, slow frames are sub-stepped
+  scenario.adaptive = true;
+  try {
+    scenario.read_arguments(arguments);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  auto simulation = scenario.build();
+  std::optional<ScenarioWatcher> watcher;
+  if (scenario.watch) {
+    watcher.emplace(*simulation, arguments);
+  }
 
   // Creating the object by passing Height and Width value.
-  Framework fw(&simulation, HEIGHT, WIDTH);
+  Framework fw(simulation.get(), scenario.height + 1, scenario.width + 1);
 
   SDL_Event event{};
   unsigned FPS;
@@ -0,0 +1,78 @@
+//
+// Example consumer of a live export: attaches to the shared memory a running
+// simulation writes to (output.live_export in a scenario) and reports, at
+// its own rate, which frames it saw and where the flock is.
+//
+// usage: attach <name> [interval_ms] [reads]
+//
+// e.g. simulate scenario.toml output.live_export=\"/boids\" &
+//      attach /boids 100
+//
+
+#define SDL_MAIN_HANDLED
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <particle/live_export.h>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "usage: attach <name> [interval_ms] [reads]" << std::endl;
+    return 1;
+  }
+  const std::chrono::milliseconds interval(argc > 2 ? std::stoul(argv[2])
+                                                    : 100);
+  const size_t reads = argc > 3 ? std::stoul(argv[3]) : 50;
+
+  LiveExport<Space2D> live;
+  try {
+    live = LiveExport<Space2D>::open(argv[1]);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "attached to " << argv[1] << ": " << live.capacity()
+            << " particles, " << live.slots() << " slots" << std::endl;
+
+  uint64_t last = 0;
+  size_t retries = 0;
+  for (size_t r = 0; r < reads; ++r) {
+    std::this_thread::sleep_for(interval);
+    Space2D center{0, 0};
+    float speed = 0;
+    uint64_t frame = 0;
+    size_t count = 0;
+    // reads the slot in place, retried if the producer overwrote it meanwhile
+    while (!live.view([&](uint64_t f, size_t n, const Space2D *position,
+                          const Space2D *velocity, const cl_int4 *) {
+      frame = f;
+      count = n;
+      center = {0, 0};
+      speed = 0;
+      for (size_t i = 0; i < n; ++i) {
+        center.x += position[i].x / static_cast<float>(n);
+        center.y += position[i].y / static_cast<float>(n);
+        speed += std::hypot(velocity[i].x, velocity[i].y) /
+                 static_cast<float>(n);
+      }
+    })) {
+      if (live.frames() == 0) {
+        break;
+      }
+      ++retries;
+    }
+    if (live.frames() == 0) {
+      continue;
+    }
+    std::cout << "frame " << frame << " (+" << frame - last << "): " << count
+              << " boids around (" << center.x << ", " << center.y
+              << "), mean speed " << speed << std::endl;
+    last = frame;
+  }
+  std::cout << retries << " torn reads retried" << std::endl;
+  return 0;
+}
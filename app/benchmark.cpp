@@ -0,0 +1,307 @@
+//
+// Headless benchmark: steps a BoidsSimulation with a fixed dt and reports
+// throughput, overall and per NUMA node.
+//
+// usage: benchmark [num_boids] [steps] [threads] [--pin] [--packed]
+//                  [--incremental] [--verlet] [--far-field] [--lod]
+//                  [--analytics] [--adaptive] [--tiled] [--balanced]
+//                  [--clusters]
+//                  [--semi-implicit | --velocity-verlet]
+//
+// --packed reads neighbors from the 16-bit fixed-point copies in the grid and
+// reports how far one step deviates from the float kernel. --incremental only
+// moves boids that changed their cell instead of rebuilding the grid.
+// --verlet iterates per-boid neighbor lists with a skin of 5. --far-field
+// adds the Barnes-Hut flock attraction (theta 0.5) and reports its error
+// against the direct sum for a sample of boids. --lod updates sparse cells
+// every 4th step and isolated boids ballistically. --analytics reduces flock
+// metrics during the step and prints the summary of the last one.
+// --adaptive sub-steps updates longer than the CFL-style safe timestep.
+// --semi-implicit and --velocity-verlet select the integrator. --tiled runs
+// the rule pass by cell tiles along a Hilbert curve instead of index order.
+// --balanced cuts the rule pass into chunks of equal estimated cost and
+// reports how evenly the time of the last rule pass was spread over them.
+// --clusters starts the boids in 8 dense clusters instead of spread evenly.
+//
+
+#define SDL_MAIN_HANDLED
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <particle/boids.h>
+
+#define WIDTH 4000
+#define HEIGHT 4000
+
+// relative error of the Barnes-Hut attraction against the O(n^2) sum
+void report_far_field_error(const BoidsSimulation<Space2D> &simulation,
+                            float theta) {
+  const auto &particles = simulation.particles();
+  const Space2D *position = particles.position_data();
+  const float softening = simulation.species()[0].cohesion_radius;
+  const size_t stride = std::max<size_t>(1, particles.size() / 100);
+  double sum = 0;
+  double max = 0;
+  size_t samples = 0;
+  for (size_t i = 0; i < particles.size(); i += stride) {
+    Space2D exact{0, 0};
+    for (size_t j = 0; j < particles.size(); ++j) {
+      float dx = position[j].x - position[i].x;
+      float dy = position[j].y - position[i].y;
+      float r_sq = dx * dx + dy * dy + softening * softening;
+      float f = j != i ? 1 / (r_sq * std::sqrt(r_sq)) : 0;
+      exact.x += dx * f;
+      exact.y += dy * f;
+    }
+    Space2D approx =
+        simulation.far_field().attraction(position[i], i, theta, softening);
+    double error = std::hypot(exact.x - approx.x, exact.y - approx.y) /
+                   std::hypot(exact.x, exact.y);
+    sum += error;
+    max = std::max(max, error);
+    ++samples;
+  }
+  std::cout << "far field:  " << simulation.far_field().size()
+            << " nodes, relative error mean " << std::setprecision(4)
+            << sum / samples << ", max " << max << std::endl;
+}
+
+// step reference and packed from the same state once and compare velocities
+void report_packed_error(BoidsSimulation<Space2D> &reference,
+                         BoidsSimulation<Space2D> &packed, Duration dt) {
+  auto &a = reference.particles();
+  auto &b = packed.particles();
+  std::copy_n(b.position_data(), b.size(), a.position_data());
+  std::copy_n(b.velocity_data(), b.size(), a.velocity_data());
+  reference.update(dt);
+  packed.update(dt);
+
+  std::vector<double> error(a.size());
+  double speed = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    const Space2D &u = a.velocity_data()[i];
+    const Space2D &v = b.velocity_data()[i];
+    error[i] = std::hypot(u.x - v.x, u.y - v.y);
+    speed += std::hypot(u.x, u.y);
+  }
+  std::sort(error.begin(), error.end());
+  std::cout << "packed velocity error after one step (mean speed "
+            << std::setprecision(3) << speed / a.size() << "): median "
+            << error[error.size() / 2] << ", p99 "
+            << error[error.size() * 99 / 100] << ", max " << error.back()
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  size_t num_boids = 100000;
+  size_t steps = 100;
+  uint num_threads = std::thread::hardware_concurrency();
+  bool pin = false;
+  bool packed = false;
+  bool incremental = false;
+  bool verlet = false;
+  bool far_field = false;
+  bool lod = false;
+  bool analytics = false;
+  bool adaptive = false;
+  bool tiled = false;
+  bool balanced = false;
+  bool clusters = false;
+  INTEGRATOR integrator = INTEGRATOR::EULER;
+
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--pin") == 0) {
+      pin = true;
+    } else if (std::strcmp(argv[i], "--packed") == 0) {
+      packed = true;
+    } else if (std::strcmp(argv[i], "--incremental") == 0) {
+      incremental = true;
+    } else if (std::strcmp(argv[i], "--verlet") == 0) {
+      verlet = true;
+    } else if (std::strcmp(argv[i], "--far-field") == 0) {
+      far_field = true;
+    } else if (std::strcmp(argv[i], "--lod") == 0) {
+      lod = true;
+    } else if (std::strcmp(argv[i], "--analytics") == 0) {
+      analytics = true;
+    } else if (std::strcmp(argv[i], "--adaptive") == 0) {
+      adaptive = true;
+    } else if (std::strcmp(argv[i], "--tiled") == 0) {
+      tiled = true;
+    } else if (std::strcmp(argv[i], "--balanced") == 0) {
+      balanced = true;
+    } else if (std::strcmp(argv[i], "--clusters") == 0) {
+      clusters = true;
+    } else if (std::strcmp(argv[i], "--semi-implicit") == 0) {
+      integrator = INTEGRATOR::SEMI_IMPLICIT_EULER;
+    } else if (std::strcmp(argv[i], "--velocity-verlet") == 0) {
+      integrator = INTEGRATOR::VELOCITY_VERLET;
+    } else {
+      positional.emplace_back(argv[i]);
+    }
+  }
+  if (positional.size() > 0)
+    num_boids = std::stoul(positional[0]);
+  if (positional.size() > 1)
+    steps = std::stoul(positional[1]);
+  if (positional.size() > 2)
+    num_threads = std::stoul(positional[2]);
+
+  BoidsSimulation<Space2D> simulation(num_boids, {WIDTH, HEIGHT, 30},
+                                      num_threads, pin);
+  auto init_start = std::chrono::steady_clock::now();
+  simulation.randomize(
+      clusters ? Distribution2D::clusters({{500, 700}, {900, 3100},
+                                           {1400, 1800}, {2000, 2000},
+                                           {2300, 600}, {2900, 3300},
+                                           {3300, 1500}, {3600, 2600}},
+                                          150)
+               : Distribution2D::uniform({10, 10}, {WIDTH - 10, HEIGHT - 10}),
+      Distribution2D::zero(), 0);
+  Duration init = std::chrono::steady_clock::now() - init_start;
+  simulation.grid().set_incremental(incremental);
+  simulation.set_neighbor_list_skin(verlet ? 5 : 0);
+  simulation.set_far_field(far_field ? 0.3f : 0, 0.5f);
+  simulation.set_lod(lod);
+  simulation.set_analytics(analytics);
+  simulation.set_adaptive_timestep(adaptive);
+  simulation.set_integrator(integrator);
+  simulation.set_tiled_rules(tiled);
+  simulation.set_load_balancing(balanced);
+
+  const Duration dt(1.0 / 60.0);
+  // warm up
+  simulation.update(dt);
+  if (packed) {
+    BoidsSimulation<Space2D> reference(num_boids, {WIDTH, HEIGHT, 30},
+                                       num_threads);
+    simulation.set_packed_neighbors(true);
+    report_packed_error(reference, simulation, dt);
+  }
+  simulation.reset_partition_stats();
+
+  size_t moved = 0;
+  const size_t rebuilds = simulation.grid().rebuilds();
+  const size_t list_builds = simulation.neighbor_list().builds();
+  auto start = std::chrono::steady_clock::now();
+  for (size_t step = 0; step < steps; ++step) {
+    simulation.update(dt);
+    moved += simulation.grid().last_moved();
+  }
+  Duration elapsed = std::chrono::steady_clock::now() - start;
+
+  const double boid_steps = static_cast<double>(num_boids) * steps;
+  std::cout << "boids:      " << num_boids << std::endl;
+  std::cout << "steps:      " << steps << std::endl;
+  std::cout << "init:       " << std::fixed << std::setprecision(2)
+            << init.count() * 1000 << " ms" << std::endl;
+  std::cout << "threads:    " << num_threads << (pin ? " (pinned)" : "")
+            << std::endl;
+  std::cout << "neighbors:  " << (packed ? "packed 16-bit" : "float")
+            << std::endl;
+  std::cout << "integrator: "
+            << (integrator == INTEGRATOR::SEMI_IMPLICIT_EULER ? "semi-implicit"
+                : integrator == INTEGRATOR::VELOCITY_VERLET   ? "velocity verlet"
+                                                              : "euler")
+            << std::endl;
+  std::cout << "grid:       "
+            << (incremental ? "incremental, " : "rebuilt, ")
+            << std::fixed << std::setprecision(1) << 100.0 * moved / boid_steps
+            << "% moved/step, " << simulation.grid().rebuilds() - rebuilds
+            << " rebuilds" << std::endl;
+  if (verlet) {
+    std::cout << "lists:      "
+              << simulation.neighbor_list().builds() - list_builds
+              << " builds, " << std::setprecision(1)
+              << static_cast<double>(simulation.neighbor_list().pairs()) /
+                     num_boids
+              << " neighbors/boid" << std::endl;
+  }
+  if (tiled) {
+    std::cout << "tiles:      " << simulation.tiles().size() << " of "
+              << simulation.tiles().side() << "x" << simulation.tiles().side()
+              << " cells" << std::endl;
+  }
+  if (!simulation.rule_chunks().empty()) {
+    double slowest = 0;
+    double sum = 0;
+    for (const auto &chunk : simulation.rule_chunks()) {
+      slowest = std::max(slowest, chunk.seconds);
+      sum += chunk.seconds;
+    }
+    std::cout << "chunks:     " << simulation.rule_chunks().size()
+              << " rule chunks" << (balanced ? " by cost" : "")
+              << ", slowest " << std::setprecision(2) << slowest * 1000
+              << " ms, mean "
+              << sum / simulation.rule_chunks().size() * 1000 << " ms"
+              << std::endl;
+  }
+  if (adaptive) {
+    std::cout << "timestep:   safe " << std::setprecision(2)
+              << simulation.safe_timestep().count() * 1000 << " ms, "
+              << simulation.substeps() << " sub-step(s)/update" << std::endl;
+  }
+  if (lod) {
+    const auto &counts = simulation.lod().counts();
+    std::cout << "lod:        " << counts[0] << " full, " << counts[1]
+              << " sparse, " << counts[2] << " ballistic" << std::endl;
+  }
+  if (analytics) {
+    const FlockStats &stats = simulation.analytics();
+    std::cout << "flock:      order " << std::setprecision(3) << stats.order
+              << ", mean speed " << stats.mean_speed << ", " << stats.clusters
+              << " clusters (largest " << stats.largest_cluster << "), "
+              << stats.isolated << " isolated" << std::endl;
+    std::cout << "nearest:   ";
+    for (size_t count : stats.nearest) {
+      std::cout << " " << count;
+    }
+    std::cout << " (bins of " << std::setprecision(2)
+              << stats.range / stats.nearest.size() << ")" << std::endl;
+  }
+  if (far_field) {
+    report_far_field_error(simulation, 0.5f);
+  }
+  const MemoryReport memory = simulation.memory_report();
+  std::cout << "memory:     " << std::setprecision(1)
+            << static_cast<double>(memory.total()) / num_boids
+            << " bytes/boid (";
+  for (size_t e = 0; e < memory.entries().size(); ++e) {
+    if (memory.entries()[e].bytes > 0) {
+      std::cout << (e > 0 ? ", " : "") << memory.entries()[e].name << " "
+                << static_cast<double>(memory.entries()[e].bytes) / num_boids;
+    }
+  }
+  std::cout << ")" << std::endl;
+  std::cout << "time/step:  " << std::fixed << std::setprecision(3)
+            << elapsed.count() * 1000 / steps << " ms" << std::endl;
+  std::cout << "throughput: " << std::setprecision(2)
+            << boid_steps / elapsed.count() / 1e6 << " M boid-steps/s"
+            << std::endl;
+
+  // per-particle phases (rules, integration) are partitioned per worker, so
+  // their work can be attributed to the NUMA node the worker runs on. Each
+  // boid is counted once per partitioned phase.
+  std::vector<size_t> processed(simulation.workers().num_nodes(), 0);
+  std::vector<double> busy(simulation.workers().num_nodes(), 0);
+  for (const auto &part : simulation.partition_stats()) {
+    processed[part.node] += part.processed;
+    busy[part.node] += part.seconds;
+  }
+  for (size_t node = 0; node < processed.size(); ++node) {
+    std::cout << "node " << node << ":     " << std::setprecision(2)
+              << processed[node] / elapsed.count() / 1e6
+              << " M particle-updates/s (busy " << std::setprecision(3)
+              << busy[node] << " s)" << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,143 @@
+//
+// Headless driver: sets up a boids simulation from scenario files and
+// command-line overrides, runs it for the configured number of steps and
+// writes the configured outputs. See particle/scenario.h for the format.
+//
+// usage: simulate [scenario.toml ...] [section.key=value ...]
+//
+// e.g. simulate scenarios/flock.toml simulation.boids=200000 run.steps=500
+//
+// With run.watch=true, the species are reloaded whenever a scenario file is
+// saved while the simulation runs.
+//
+
+#define SDL_MAIN_HANDLED
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <particle/scenario.h>
+
+// opens path for writing, or returns nullptr if path is empty
+std::unique_ptr<std::ofstream> open_output(const std::string &path,
+                                           const std::string &header) {
+  if (path.empty()) {
+    return nullptr;
+  }
+  auto out = std::make_unique<std::ofstream>(path);
+  if (!*out) {
+    throw std::runtime_error("cannot write '" + path + "'");
+  }
+  *out << header << '\n';
+  return out;
+}
+
+void write_stats(std::ostream &out, size_t step, const FlockStats &stats) {
+  out << step << ',' << stats.boids << ',' << stats.order << ','
+      << stats.mean_speed << ',' << stats.clusters << ','
+      << stats.largest_cluster << ',' << stats.isolated;
+  for (size_t count : stats.nearest) {
+    out << ',' << count;
+  }
+  out << '\n';
+}
+
+void write_positions(std::ostream &out, size_t step,
+                     const Particles<Space2D> &particles) {
+  for (size_t i = 0; i < particles.size(); ++i) {
+    const Space2D &p = particles.position_data()[i];
+    const Space2D &v = particles.velocity_data()[i];
+    out << step << ',' << i << ',' << p.x << ',' << p.y << ',' << v.x << ','
+        << v.y << ',' << static_cast<int>(particles.species_data()[i]) << '\n';
+  }
+}
+
+int main(int argc, char **argv) {
+  const std::vector<std::string> arguments(argv + 1, argv + argc);
+  Scenario scenario;
+  std::unique_ptr<BoidsSimulation<Space2D>> simulation;
+  std::unique_ptr<std::ofstream> stats;
+  std::unique_ptr<std::ofstream> positions;
+  std::optional<ScenarioWatcher> watcher;
+  try {
+    scenario.read_arguments(arguments);
+    simulation = scenario.build();
+    if (scenario.watch) {
+      watcher.emplace(*simulation, arguments);
+    }
+    std::string header = "step,boids,order,mean_speed,clusters,"
+                         "largest_cluster,isolated";
+    for (size_t b = 0; b < scenario.analytics_bins; ++b) {
+      header += ",nearest_" + std::to_string(b);
+    }
+    stats = open_output(scenario.stats_path, header);
+    positions = open_output(scenario.positions_path,
+                            "step,index,x,y,vx,vy,species");
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << "scenario:   " << scenario.num_boids << " boids, "
+            << scenario.width << "x" << scenario.height << ", "
+            << simulation->num_threads() << " threads, "
+            << scenario.steps << " steps of " << scenario.dt.count() * 1000
+            << " ms" << std::endl;
+
+  auto start = std::chrono::steady_clock::now();
+  auto last = start;
+  for (size_t step = 1; step <= scenario.steps; ++step) {
+    simulation->update(scenario.dt);
+    if (stats && scenario.stats_every > 0 &&
+        step % scenario.stats_every == 0) {
+      write_stats(*stats, step, simulation->analytics());
+    }
+    if (positions && scenario.positions_every > 0 &&
+        step % scenario.positions_every == 0) {
+      write_positions(*positions, step, simulation->particles());
+    }
+    if (scenario.summary_every > 0 && step % scenario.summary_every == 0) {
+      auto now = std::chrono::steady_clock::now();
+      Duration elapsed = now - last;
+      last = now;
+      std::cout << "step " << std::setw(8) << step << ": " << std::fixed
+                << std::setprecision(3)
+                << elapsed.count() * 1000 / scenario.summary_every
+                << " ms/step";
+      if (scenario.analytics) {
+        const FlockStats &flock = simulation->analytics();
+        std::cout << ", order " << flock.order << ", " << flock.clusters
+                  << " clusters";
+      }
+      std::cout << std::endl;
+    }
+  }
+  Duration elapsed = std::chrono::steady_clock::now() - start;
+
+  if (watcher) {
+    std::cout << "reloads:    " << watcher->reloads() << " published, "
+              << simulation->species_updates()
+              << " applied";
+    if (!watcher->last_error().empty()) {
+      std::cout << ", last error: " << watcher->last_error();
+    }
+    std::cout << std::endl;
+  }
+  const MemoryReport memory = simulation->memory_report();
+  std::cout << "time/step:  " << std::fixed << std::setprecision(3)
+            << elapsed.count() * 1000 / scenario.steps << " ms" << std::endl;
+  std::cout << "throughput: " << std::setprecision(2)
+            << static_cast<double>(scenario.num_boids) * scenario.steps /
+                   elapsed.count() / 1e6
+            << " M boid-steps/s" << std::endl;
+  std::cout << "memory:     " << std::setprecision(1)
+            << static_cast<double>(memory.total()) / (1 << 20) << " MiB"
+            << std::endl;
+  return 0;
+}
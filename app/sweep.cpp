@@ -0,0 +1,55 @@
+//
+// Parameter sweep: runs one small boids simulation per combination of rule
+// radii and max speed on all cores and prints one CSV line per member.
+//
+// usage: sweep [boids_per_run] [steps] [repetitions] [threads]
+//
+
+#define SDL_MAIN_HANDLED
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <particle/ensemble.h>
+
+int main(int argc, char **argv) {
+  EnsembleConfig config;
+  config.num_boids = argc > 1 ? std::stoul(argv[1]) : 1000;
+  config.steps = argc > 2 ? std::stoul(argv[2]) : 500;
+  size_t repetitions = argc > 3 ? std::stoul(argv[3]) : 2;
+  uint num_threads = argc > 4 ? std::stoul(argv[4])
+                              : std::thread::hardware_concurrency();
+
+  ParameterSweep sweep;
+  sweep.separation_radius = {5, 10, 15};
+  sweep.alignment_radius = {20, 30, 40};
+  sweep.cohesion_radius = {20, 30, 40};
+  sweep.max_speed = {50, 100};
+
+  Ensemble<Space2D> ensemble(config, num_threads);
+  auto start = std::chrono::steady_clock::now();
+  auto results = ensemble.run(sweep, repetitions);
+  Duration elapsed = std::chrono::steady_clock::now() - start;
+
+  std::cout << "separation_radius,alignment_radius,cohesion_radius,max_speed,"
+               "seed,order,mean_speed,seconds"
+            << std::endl;
+  double busy = 0;
+  for (const auto &r : results) {
+    std::cout << r.parameters.separation_radius << ","
+              << r.parameters.alignment_radius << ","
+              << r.parameters.cohesion_radius << "," << r.parameters.max_speed
+              << "," << r.seed << "," << r.order << "," << r.mean_speed << ","
+              << r.seconds << std::endl;
+    busy += r.seconds;
+  }
+  // members run on one worker each, so busy time over wall time per worker
+  // is how well the cores were used
+  std::cerr << results.size() << " runs in " << elapsed.count() << " s on "
+            << ensemble.num_threads() << " threads, utilization "
+            << 100 * busy / (elapsed.count() * ensemble.num_threads()) << "%"
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,97 @@
+//
+// Runs a boids simulation split into tiles_x * tiles_y tiles, one process per
+// tile, exchanging halos and migrating boids over shared memory.
+//
+// usage: tiles [tiles_x] [tiles_y] [boids_per_tile] [steps]
+//
+
+#define SDL_MAIN_HANDLED
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <particle/boids.h>
+#include <particle/domain.h>
+
+#define WIDTH 2000
+#define HEIGHT 2000
+#define CELL_SIZE 30
+
+int run_tile(const std::string &session, const Tiling &tiling, int rank,
+             size_t num_boids, size_t steps) {
+  try {
+    BoidsSimulation<Space2D> simulation(num_boids,
+                                        tiling.grid(rank, CELL_SIZE), 1);
+    if (simulation.interaction_radius() > static_cast<float>(tiling.halo)) {
+      std::cerr << "halo is smaller than the interaction radius" << std::endl;
+      return 1;
+    }
+    simulation.set_space(tiling.domain);
+    Space tile = tiling.tile(rank);
+    simulation.randomize(
+        Distribution2D::uniform(
+            {static_cast<float>(tile.position.x),
+             static_cast<float>(tile.position.y)},
+            {static_cast<float>(tile.position.x + tile.size.x - 1),
+             static_cast<float>(tile.position.y + tile.size.y - 1)}),
+        Distribution2D::zero(), rank);
+
+    TileExchange<Space2D> exchange(session, tiling, rank);
+    const Duration dt(1.0 / 60.0);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t step = 0; step < steps; ++step) {
+      exchange.exchange(simulation);
+      simulation.update(dt);
+    }
+    Duration elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "tile " << rank << ": " << simulation.particles().size()
+              << " boids, " << simulation.particles().ghosts() << " ghosts, "
+              << exchange.migrated_in() << " in, " << exchange.migrated_out()
+              << " out, " << elapsed.count() * 1000 / steps << " ms/step"
+              << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << "tile " << rank << ": " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int tiles_x = argc > 1 ? std::stoi(argv[1]) : 2;
+  int tiles_y = argc > 2 ? std::stoi(argv[2]) : 2;
+  size_t boids_per_tile = argc > 3 ? std::stoul(argv[3]) : 10000;
+  size_t steps = argc > 4 ? std::stoul(argv[4]) : 100;
+
+  Tiling tiling{{{0, 0}, {WIDTH, HEIGHT}}, tiles_x, tiles_y, CELL_SIZE};
+  const std::string session = "boids_" + std::to_string(getpid());
+
+  for (int rank = 0; rank < tiling.num_tiles(); ++rank) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      std::cerr << "fork failed" << std::endl;
+      return 1;
+    }
+    if (pid == 0) {
+      _exit(run_tile(session, tiling, rank, boids_per_tile, steps));
+    }
+  }
+
+  // a failing tile only takes down its own process, its neighbors time out
+  int failed = 0;
+  for (int i = 0; i < tiling.num_tiles(); ++i) {
+    int status = 0;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      ++failed;
+    }
+  }
+  if (failed > 0) {
+    std::cerr << failed << " tile(s) failed" << std::endl;
+  }
+  return failed > 0 ? 1 : 0;
+}
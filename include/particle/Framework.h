@@ -16,7 +16,7 @@ public:
         SDL_SetRenderDrawColor(_renderer, 0, 0, 0, 0);      // setting draw color
         SDL_RenderClear(_renderer);      // Clear the newly created window
         SDL_RenderPresent(_renderer);    // Reflects the changes done in the
-        _sim->_particles.set_random_positions(10, width- 10, 10, _height - 10);
+        _sim->set_snapshots(true);
     }
 
     // Destructor
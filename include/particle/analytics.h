@@ -0,0 +1,247 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <particle/grid.h>
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+/// compact per-step summary of the flock
+struct FlockStats {
+  uint64_t step{0};
+  size_t boids{0};
+  /// length of the mean heading, 1 if all boids fly the same direction
+  float order{0};
+  float mean_speed{0};
+  /// nearest neighbor distances in [0, range), bins of equal width
+  std::vector<size_t> nearest;
+  float range{0};
+  /// boids whose nearest neighbor is range or further away
+  size_t isolated{0};
+  /// groups of boids in connected occupied grid cells
+  size_t clusters{0};
+  size_t largest_cluster{0};
+};
+
+template <Dimension S> class FlockAnalytics {};
+
+/**
+ * Flock metrics reduced during the rule pass instead of from dumped
+ * positions. Every partition accumulates a Partial and merges it once at its
+ * end. Clusters are connected components of the occupied grid cells (8
+ * neighborhood), found with a lock-free union-find over the cells.
+ */
+template <> class FlockAnalytics<Space2D> {
+public:
+  class Partial {
+  public:
+    Partial(size_t bins, float range)
+        : _nearest(bins, 0), _bin_scale(bins / range) {}
+
+    void add_velocity(const Space2D &velocity) {
+      float speed =
+          std::sqrt(velocity.x * velocity.x + velocity.y * velocity.y);
+      if (speed > 0) {
+        _heading_x += velocity.x / speed;
+        _heading_y += velocity.y / speed;
+      }
+      _speed += speed;
+      ++_boids;
+    }
+
+    /// infinity if no neighbor was seen
+    void add_nearest(float distance) {
+      float bin = distance * _bin_scale;
+      if (bin < static_cast<float>(_nearest.size())) {
+        ++_nearest[static_cast<size_t>(bin)];
+      } else {
+        ++_isolated;
+      }
+    }
+
+  private:
+    friend class FlockAnalytics;
+
+    double _heading_x{0};
+    double _heading_y{0};
+    double _speed{0};
+    size_t _boids{0};
+    size_t _isolated{0};
+    std::vector<size_t> _nearest;
+    float _bin_scale;
+  };
+
+  explicit FlockAnalytics(size_t bins = 16) : _bins(bins) {}
+
+  /// takes effect with the next begin()
+  void set_bins(size_t bins) { _bins = bins; }
+
+  /// reset the sums; nearest distances from range on count as isolated
+  void begin(float range, uint64_t step) {
+    _range = range;
+    _heading_x = 0;
+    _heading_y = 0;
+    _speed = 0;
+    _next = {};
+    _next.step = step;
+    _next.range = range;
+    _next.nearest.assign(_bins, 0);
+  }
+
+  [[nodiscard]] Partial partial() const { return {_bins, _range}; }
+
+  void merge(const Partial &partial) {
+    std::lock_guard lock(_mutex);
+    _heading_x += partial._heading_x;
+    _heading_y += partial._heading_y;
+    _speed += partial._speed;
+    _next.boids += partial._boids;
+    _next.isolated += partial._isolated;
+    for (size_t b = 0; b < _bins; ++b) {
+      _next.nearest[b] += partial._nearest[b];
+    }
+  }
+
+  void find_clusters(Grid<Space2D> &grid, BS::thread_pool &pool) {
+    const size_t x_size = grid.x_size();
+    const size_t y_size = grid.y_size();
+    const size_t cells = x_size * y_size;
+    if (_cells != cells) {
+      _parent = std::make_unique<std::atomic<uint32_t>[]>(cells);
+      _cells = cells;
+    }
+    auto occupied = [&](size_t x, size_t y) {
+      return !grid.data()[x][y].empty();
+    };
+
+    auto init = [&](size_t beg, size_t end) {
+      for (size_t c = beg; c < end; ++c) {
+        _parent[c].store(static_cast<uint32_t>(c), std::memory_order_relaxed);
+      }
+    };
+    pool.push_loop(cells, init);
+    pool.wait_for_tasks();
+
+    // every cell links to its occupied neighbors below and to the right
+    auto link = [&](size_t beg, size_t end) {
+      for (size_t x = beg; x < end; ++x) {
+        for (size_t y = 0; y < y_size; ++y) {
+          if (!occupied(x, y)) {
+            continue;
+          }
+          const size_t c = x * y_size + y;
+          if (y + 1 < y_size && occupied(x, y + 1)) {
+            unite(c, c + 1);
+          }
+          if (x + 1 < x_size) {
+            for (size_t n_y = y > 0 ? y - 1 : 0;
+                 n_y <= std::min(y + 1, y_size - 1); ++n_y) {
+              if (occupied(x + 1, n_y)) {
+                unite(c, (x + 1) * y_size + n_y);
+              }
+            }
+          }
+        }
+      }
+    };
+    pool.push_loop(x_size, link);
+    pool.wait_for_tasks();
+
+    // particle counts per root; roots are cells, so this is a cheap pass
+    _size.assign(cells, 0);
+    for (size_t x = 0; x < x_size; ++x) {
+      for (size_t y = 0; y < y_size; ++y) {
+        if (occupied(x, y)) {
+          _size[find(x * y_size + y)] += grid.data()[x][y].size();
+        }
+      }
+    }
+    _next.clusters = 0;
+    _next.largest_cluster = 0;
+    for (size_t c = 0; c < cells; ++c) {
+      if (_size[c] > 0) {
+        ++_next.clusters;
+        _next.largest_cluster = std::max(_next.largest_cluster, _size[c]);
+      }
+    }
+  }
+
+  /// publish the sums merged since begin()
+  void finish() {
+    if (_next.boids > 0) {
+      _next.order = static_cast<float>(
+          std::sqrt(_heading_x * _heading_x + _heading_y * _heading_y) /
+          static_cast<double>(_next.boids));
+      _next.mean_speed = static_cast<float>(_speed / _next.boids);
+    }
+    std::swap(_stats, _next);
+  }
+
+  /// summary of the last finished step
+  [[nodiscard]] const FlockStats &stats() const { return _stats; }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return _cells * sizeof(std::atomic<uint32_t>) + vector_bytes(_size);
+  }
+
+private:
+  uint32_t find(size_t c) const {
+    uint32_t node = static_cast<uint32_t>(c);
+    uint32_t parent = _parent[node].load(std::memory_order_relaxed);
+    while (parent != node) {
+      // path halving: replacing the parent by an ancestor is always valid
+      uint32_t grandparent = _parent[parent].load(std::memory_order_relaxed);
+      _parent[node].compare_exchange_weak(parent, grandparent,
+                                          std::memory_order_relaxed);
+      node = grandparent;
+      parent = _parent[node].load(std::memory_order_relaxed);
+    }
+    return node;
+  }
+
+  /// the larger root is linked below the smaller one, retried on contention
+  void unite(size_t a, size_t b) {
+    while (true) {
+      uint32_t root_a = find(a);
+      uint32_t root_b = find(b);
+      if (root_a == root_b) {
+        return;
+      }
+      if (root_a < root_b) {
+        std::swap(root_a, root_b);
+      }
+      uint32_t expected = root_a;
+      if (_parent[root_a].compare_exchange_strong(expected, root_b,
+                                                  std::memory_order_relaxed)) {
+        return;
+      }
+    }
+  }
+
+  size_t _bins;
+  float _range{1};
+  double _heading_x{0};
+  double _heading_y{0};
+  double _speed{0};
+  std::mutex _mutex;
+  FlockStats _next;
+  FlockStats _stats;
+
+  std::unique_ptr<std::atomic<uint32_t>[]> _parent;
+  size_t _cells{0};
+  std::vector<size_t> _size;
+};
@@ -4,205 +4,857 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <tuple>
 #include <vector>
 
+#include <particle/analytics.h>
+#include <particle/cell_cost.h>
+#include <particle/cell_tiles.h>
 #include <particle/grid.h>
+#include <particle/lod.h>
+#include <particle/neighbor_list.h>
 #include <particle/particle.h>
+#include <particle/quadtree.h>
+#include <particle/rules.h>
+#include <particle/sdf.h>
+#include <particle/species.h>
 #include <particle/simulation.h>
 #include <particle/types.h>
+#include <particle/utils/load_balance.h>
 
 template <Dimension S>
 class BoidsSimulation : public Simulation<S> {};
 
 template <>
 class BoidsSimulation<Space2D> : public Simulation<Space2D> {
-  template <Dimension> friend class Framework;
 public:
-  explicit BoidsSimulation(size_t num_particles, Grid<Space2D> grid, uint num_threads) : Simulation<Space2D>(num_particles, grid, num_threads) {}
+  static constexpr cl_int4 predator_color{255, 0, 0, 255};
 
+  explicit BoidsSimulation(size_t num_particles, Grid<Space2D> grid, uint num_threads, bool pin_threads = false) : Simulation<Space2D>(num_particles, grid, num_threads, pin_threads) {
+    _space = _grid.extent();
+    _obstacles = SignedDistanceField<Space2D>(_grid.extent(),
+                                              _grid.grid_size() / 4.f);
+    _particles.set_palette(species_palette());
+    _predators.set_palette({predator_color});
+  }
+
+  ~BoidsSimulation() override {
+    stop_async();
+    delete _published_species.exchange(nullptr);
+  }
+
+  /**
+   * Advance by duration. With an adaptive timestep, the step is split into
+   * equal sub-steps no longer than safe_timestep(); if that needs more than
+   * max_substeps, the simulation falls behind wall-clock time instead of
+   * taking unstable steps.
+   */
   void update(Duration duration) override {
-    _grid.update(_particles);
-    updateBoids(duration);
+    take_published_species();
+    if (!_adaptive_timestep) {
+      step(duration);
+      return;
+    }
+    const Duration safe = safe_timestep();
+    // compared as double first, a ratio of +inf or NaN has no size_t value
+    const double ratio = std::ceil(duration / safe);
+    _substeps = ratio >= 1 ? static_cast<size_t>(std::min<double>(
+                                 ratio, static_cast<double>(_max_substeps)))
+                           : 1;
+    const Duration dt = std::min(duration / _substeps, safe);
+    for (size_t s = 0; s < _substeps && !cancelled(); ++s) {
+      step(dt);
+    }
+  }
+
+  /**
+   * Pick dt per update such that no boid or predator moves more than
+   * courant times the smallest interaction radius (rule radii and, with
+   * obstacles, the obstacle radius) in one step, which keeps fast boids from
+   * skipping over neighbors, obstacles and borders.
+   */
+  void set_adaptive_timestep(bool enabled, float courant = 0.5f,
+                             size_t max_substeps = 8) {
+    _adaptive_timestep = enabled;
+    _courant = courant;
+    _max_substeps = std::max<size_t>(1, max_substeps);
+  }
+
+  /// largest dt the adaptive timestep takes with the current settings
+  [[nodiscard]] Duration safe_timestep() const {
+    float radius = _species.min_radius();
+    if (!_obstacles.empty()) {
+      radius = std::min(radius, _obstacle_radius);
+    }
+    float speed = _species.max_speed();
+    if (_predators.size() > 0) {
+      speed = std::max(speed, _predator_max_speed);
+    }
+    return Duration(speed > 0 ? _courant * radius / speed
+                              : std::numeric_limits<double>::infinity());
+  }
+
+  /**
+   * How velocities and positions are advanced. EULER adds the steering to
+   * the velocity once per step, independent of dt, while the rule pass runs.
+   * The other integrators treat steering_rate times the steering as an
+   * acceleration and apply it in the move pass, so the result converges as
+   * dt shrinks and larger steps stay accurate. steering_rate 60 matches EULER
+   * at 60 steps per second. VELOCITY_VERLET keeps the accelerations of the
+   * last step; it restarts from the current velocities after boids were
+   * spawned or removed.
+   */
+  void set_integrator(INTEGRATOR integrator, float steering_rate = 60) {
+    if (integrator != _integrator) {
+      // the stored velocities are no Verlet predictions for these
+      _previous_acceleration.clear();
+    }
+    _integrator = integrator;
+    _steering_rate = steering_rate;
+  }
+
+  [[nodiscard]] INTEGRATOR integrator() const { return _integrator; }
+
+  /**
+   * Boids are drawn in the color of their species, so by default the
+   * particles keep a palette indexed by species instead of a color per boid.
+   * Disable to store per-boid colors again (16 bytes per boid).
+   */
+  void set_palette_colors(bool enabled) {
+    if (enabled) {
+      _particles.set_palette(species_palette());
+    } else {
+      _particles.clear_palette();
+    }
+  }
+
+  [[nodiscard]] MemoryReport memory_report() const override {
+    MemoryReport report = Simulation<Space2D>::memory_report();
+    report.add("predators", _predators.memory_usage());
+    report.add("neighbor lists", _neighbor_list.memory_usage());
+    report.add("far field", _far_field.memory_usage());
+    report.add("obstacles", _obstacles.memory_usage());
+    report.add("level of detail", _lod.memory_usage());
+    report.add("analytics", _analytics.memory_usage());
+    report.add("tiles", _tiles.memory_usage());
+    report.add("load balancing",
+               _cell_cost.memory_usage() + vector_bytes(_block_cost));
+    report.add("integrator", vector_bytes(_acceleration) +
+                                 vector_bytes(_previous_acceleration));
+    return report;
+  }
+
+  /// sub-steps the last adaptive update was split into
+  [[nodiscard]] size_t substeps() const { return _substeps; }
+
+  /// static obstacles, the distance field is rebuilt on the next update
+  void add_obstacle(CircleObstacle obstacle) { _obstacles.add(obstacle); }
+  void add_obstacle(BoxObstacle obstacle) { _obstacles.add(obstacle); }
+
+  ParticleHandle spawn_predator(Space2D position, Space2D velocity) {
+    return _predators.spawn(position, velocity);
+  }
+
+  bool despawn_predator(ParticleHandle handle) {
+    return _predators.despawn(handle);
+  }
+
+  [[nodiscard]] const Particles<Space2D> &predators() const {
+    return _predators;
   }
   
+  /// largest radius any rule looks at, i.e. the halo width a tile needs
+  [[nodiscard]] float interaction_radius() const {
+    return _species.max_radius();
+  }
+
+  /// rule parameters per species, species 0 is used by default
+  SpeciesTable &species() {
+    // the caller may change colors through the reference
+    _palette_stale = true;
+    return _species;
+  }
+  [[nodiscard]] const SpeciesTable &species() const { return _species; }
+
+  /**
+   * Replace the species parameters from any thread while the simulation
+   * runs; species() may only be used from the thread that updates. The
+   * table is taken over at the start of the next update() with one atomic
+   * exchange, a table published before that replaces the pending one. If
+   * the largest rule radius changed, the grid is re-cut into cells of that
+   * size, so the 3x3 cell scan keeps seeing every neighbor. Tables with
+   * fewer species than the current one are dropped, particles may still
+   * refer to the missing species.
+   */
+  void publish_species(SpeciesTable species) {
+    delete _published_species.exchange(new SpeciesTable(std::move(species)),
+                                       std::memory_order_acq_rel);
+  }
+
+  /// published tables taken over so far
+  [[nodiscard]] size_t species_updates() const { return _species_updates; }
+
+  /**
+   * Keep one grid layer per species so boids skip the cells of species they
+   * do not interact with. Pays off if most species ignore each other.
+   */
+  void set_species_bucketing(bool enabled) { _bucket_species = enabled; }
+
+  /**
+   * Read neighbors from 16-bit fixed-point copies kept in the grid cells
+   * instead of gathering their float positions and velocities. Positions are
+   * quantized to grid_size / 65536, velocities to max_speed / 32767; boids
+   * outside their cell are read at full precision. The copies take 12 bytes
+   * per boid on top of the float storage.
+   */
+  void set_packed_neighbors(bool enabled) { _packed_neighbors = enabled; }
+
+  /**
+   * Iterate per-boid Verlet lists (radius: largest rule radius + skin) that
+   * are rebuilt only once a boid moved more than skin / 2, instead of
+   * scanning the cell block around every boid. 0 disables the lists. Takes
+   * precedence over packed neighbors.
+   */
+  void set_neighbor_list_skin(float skin) {
+    _neighbor_lists = skin > 0;
+    _neighbor_list.set_skin(skin);
+  }
+
+  [[nodiscard]] const NeighborList<Space2D> &neighbor_list() const {
+    return _neighbor_list;
+  }
+
+  /**
+   * Weak attraction toward the mass of the whole flock, in addition to the
+   * local cohesion. Evaluated with a Barnes-Hut quadtree rebuilt every step:
+   * nodes smaller than theta times their distance are taken as a whole, so
+   * smaller theta is more accurate and slower. Mass closer than the cohesion
+   * radius is softened. weight 0 disables it.
+   */
+  void set_far_field(float weight, float theta = 0.5f) {
+    _far_field_weight = weight;
+    _far_field_theta = theta;
+  }
+
+  [[nodiscard]] const QuadTree<Space2D> &far_field() const {
+    return _far_field;
+  }
+
+  /**
+   * Level of detail: boids in sparse cells run the neighbor rules only every
+   * interval-th step (with the steering scaled up to match), boids without
+   * neighbors only integrate. Obstacle and predator avoidance and the move
+   * pass run for every boid every step.
+   */
+  void set_lod(bool enabled, LodSettings settings = {}) {
+    _lod_enabled = enabled;
+    _lod = LodScheduler<Space2D>(settings);
+  }
+
+  [[nodiscard]] const LodScheduler<Space2D> &lod() const { return _lod; }
+
+  /**
+   * Reduce flock metrics during the step: order parameter and mean speed of
+   * the steered velocities, a histogram of nearest neighbor distances taken
+   * from the rule pass, and clusters of connected occupied cells. Boids the
+   * level of detail skips have no nearest neighbor sample that step.
+   */
+  void set_analytics(bool enabled, size_t bins = 16) {
+    _analytics_enabled = enabled;
+    _analytics.set_bins(bins);
+  }
+
+  /// summary of the last completed step
+  [[nodiscard]] const FlockStats &analytics() const {
+    return _analytics.stats();
+  }
+
+  /**
+   * Run the rule pass tile by tile (see CellTiles) instead of in index
+   * order: every task takes a run of cells along the Hilbert curve of
+   * tiles, so the neighbors it reads stay in cache across boids. There are a
+   * few runs per worker, so workers that finish early take over the rest.
+   * cache_bytes 0 uses the detected L2 size.
+   */
+  void set_tiled_rules(bool enabled, size_t cache_bytes = 0) {
+    _tiled_rules = enabled;
+    _tiles.set_cache_bytes(cache_bytes > 0 ? cache_bytes : l2_cache_bytes());
+  }
+
+  [[nodiscard]] const CellTiles<Space2D> &tiles() const { return _tiles; }
+
+  /**
+   * Split the rule pass into chunks of equal estimated cost instead of equal
+   * size (see CellCost: a boid costs the occupancy of the 3x3 cell block it
+   * scans), so the workers that get the dense parts of a flock do not finish
+   * last. The chunks are runs of cells with tiled rules and runs of index
+   * blocks otherwise; there are a few per worker and they are queued most
+   * expensive first. Without tiled rules this gives up the NUMA-local
+   * partitions of the rule pass.
+   */
+  void set_load_balancing(bool enabled) { _load_balancing = enabled; }
+
+  /// chunks of the last tiled or load balanced rule pass, most expensive first
+  [[nodiscard]] const std::vector<WorkChunk> &rule_chunks() const {
+    return _rule_chunks;
+  }
+
   void draw(SDL_Renderer *renderer) override {
     // _grid.draw(renderer);
-    _particles.draw(renderer);
+    if (_publish_snapshots) {
+      Snapshot<Space2D> snapshot = this->snapshot();
+      for (size_t i = 0; snapshot && i < snapshot.size(); ++i) {
+        const cl_int4 &color = snapshot.color_data()[i];
+        SDL_SetRenderDrawColor(renderer, color.x, color.y, color.z, color.w);
+        SDL_RenderDrawPoint(renderer, snapshot.position_data()[i].x,
+                            snapshot.position_data()[i].y);
+      }
+      SDL_SetRenderDrawColor(renderer, predator_color.x, predator_color.y,
+                             predator_color.z, predator_color.w);
+      for (size_t p = 0; snapshot && p < snapshot.predators(); ++p) {
+        SDL_RenderDrawPoint(renderer, snapshot.predator_position_data()[p].x,
+                            snapshot.predator_position_data()[p].y);
+      }
+    } else {
+      _particles.draw(renderer);
+      _predators.draw(renderer);
+    }
   }
 
 private:
+  void take_published_species() {
+    if (_published_species.load(std::memory_order_relaxed) == nullptr) {
+      return;
+    }
+    std::unique_ptr<SpeciesTable> published(
+        _published_species.exchange(nullptr, std::memory_order_acq_rel));
+    if (!published || published->size() < _species.size()) {
+      return;
+    }
+    const float radius = _species.max_radius();
+    _species = std::move(*published);
+    _palette_stale = true;
+    ++_species_updates;
+    if (_species.max_radius() != radius) {
+      _grid.set_grid_size(
+          static_cast<size_t>(std::ceil(_species.max_radius())));
+    }
+  }
+
+  /// one step of length duration
+  void step(Duration duration) {
+    if (cancelled()) {
+      return;
+    }
+    _obstacles.build(_thread_pool);
+    if (_palette_stale && _particles.palette_colors()) {
+      _particles.set_palette(species_palette());
+    }
+    _palette_stale = false;
+    if (_grid.species_buckets() != (_bucket_species ? _species.size() : 0)) {
+      _grid.set_species_buckets(_bucket_species ? _species.size() : 0);
+    }
+    float velocity_scale = _packed_neighbors ? _species.max_speed() : 0;
+    if (_grid.velocity_scale() != velocity_scale) {
+      _grid.set_packed(velocity_scale);
+    }
+    _grid.update(_particles);
+    _grid.update_predators(_predators);
+    if (_lod_enabled) {
+      _lod.update(_grid, _steps, _thread_pool);
+    }
+    if (_analytics_enabled) {
+      // every neighbor closer than this is seen by the rule pass
+      _analytics.begin(std::min(static_cast<float>(_grid.grid_size()),
+                                _species.max_radius()),
+                       _steps);
+      _analytics.find_clusters(_grid, _thread_pool);
+    }
+    if (_neighbor_lists &&
+        _neighbor_list.stale(_particles, _species, _thread_pool)) {
+      _neighbor_list.build(_particles, _grid, _species, _thread_pool);
+    }
+    if (_far_field_weight > 0) {
+      _far_field.build(_particles.position_data(), _particles.size(),
+                       _grid.extent(), _thread_pool);
+    }
+    if (cancelled()) {
+      return;
+    }
+    updateBoids(duration);
+    if (cancelled()) {
+      return;
+    }
+    if (_analytics_enabled) {
+      _analytics.finish();
+    }
+    updatePredators(duration);
+    _particles.compact(_thread_pool);
+    _predators.compact(_thread_pool);
+  }
+
+  using RuleKernel = void (BoidsSimulation::*)(size_t, size_t);
+  using MoveKernel = void (BoidsSimulation::*)(size_t, size_t, float);
+
   void updateBoids(Duration duration) {
-    auto apply_boids_rules = [this](int beg, int end) {
-      for (size_t i = beg; i < end; ++i) {
-        cl_float2 sep = separate(i);
-        cl_float2 ali = align(i);
-        cl_float2 coh = cohere(i);
-        
-        _particles.velocity_data()[i].x += sep.x + ali.x + coh.x;
-        _particles.velocity_data()[i].y += sep.y + ali.y + coh.y;
-
-        double speed =
-            std::sqrt(_particles.velocity_data()[i].x * _particles.velocity_data()[i].x +
-                      _particles.velocity_data()[i].y * _particles.velocity_data()[i].y);
-
-        if (speed > _max_speed) {
-          _particles.velocity_data()[i].x = (_particles.velocity_data()[i].x / speed) * _max_speed;
-          _particles.velocity_data()[i].y = (_particles.velocity_data()[i].y / speed) * _max_speed;
-        }
+    if (_integrator != INTEGRATOR::EULER) {
+      _acceleration.resize(_particles.size());
+    }
+    // the accelerations of the last step still belong to the same boids
+    _previous_acceleration_valid =
+        _integrator == INTEGRATOR::VELOCITY_VERLET &&
+        _previous_acceleration.size() == _particles.size() &&
+        _acceleration_layout == _particles.layout_version();
+    RuleKernel rules = select_rule_kernel();
+    const size_t chunks = 4 * _thread_pool.get_thread_count();
+    if (_load_balancing) {
+      _cell_cost.update(_grid, _thread_pool);
+    }
+    if (_tiled_rules) {
+      _tiles.build(_grid, _particles.size(), _thread_pool,
+                   _load_balancing ? &_cell_cost : nullptr);
+      _rule_order = _tiles.order();
+      _rule_chunks = _load_balancing
+                         ? balanced_chunks(_tiles.cost_prefix(), chunks)
+                         : even_chunks(_tiles.cells(), chunks);
+      run_largest_first(_thread_pool, _rule_chunks,
+                        [this, rules](size_t beg, size_t end) {
+                          (this->*rules)(_tiles.offset(beg),
+                                         _tiles.offset(end));
+                        });
+      _rule_order = nullptr;
+    } else if (_load_balancing) {
+      const size_t block = block_costs(16 * chunks);
+      _rule_chunks = balanced_chunks(_block_cost, chunks);
+      const size_t n = _particles.size();
+      run_largest_first(_thread_pool, _rule_chunks,
+                        [this, rules, block, n](size_t beg, size_t end) {
+                          (this->*rules)(std::min(beg * block, n),
+                                         std::min(end * block, n));
+                        });
+    } else {
+      for_each_partition([this, rules](size_t beg, size_t end) {
+        (this->*rules)(beg, end);
+      });
+    }
+    // steered but not yet moved is a consistent state to stop in
+    if (cancelled()) {
+      return;
+    }
+
+    MoveKernel move = select_move_kernel();
+    const auto dt = static_cast<float>(duration.count());
+    begin_snapshot();
+    for_each_partition([this, move, dt](size_t beg, size_t end) {
+      (this->*move)(beg, end, dt);
+      if (_snapshot != nullptr) {
+        write_snapshot(beg, end);
       }
-    };
-    _thread_pool.push_loop(_particles.size(), apply_boids_rules);
-    _thread_pool.wait_for_tasks();
+#ifdef PARTICLE_LIVE_EXPORT
+      if (_live_export) {
+        _live_export->write(beg, end, _particles);
+      }
+#endif
+    });
+    if (_snapshot != nullptr) {
+      // predators move after the boids, this is where the boids fled from
+      _snapshot->predator_position.assign(
+          _predators.position_data(),
+          _predators.position_data() + _predators.size());
+    }
+    end_snapshot();
+    if (_integrator == INTEGRATOR::VELOCITY_VERLET) {
+      std::swap(_acceleration, _previous_acceleration);
+      _acceleration_layout = _particles.layout_version();
+      _previous_dt = dt;
+    }
+  }
 
-    auto border_boids = _grid.get_at_border();
-    std::vector<size_t> bb(border_boids.begin(), border_boids.end());
-    auto border_collision = [this, &bb](auto beg, auto end) {
-      for (int i = beg; i < end; ++i) {
-        switch (_border) {
-        case BORDER::REFLECTIVE:
-          reflection(bb[i]);
-          break;
-        case BORDER::TOROIDAL:
-          toroid(bb[i]);
-          break;
-        default:
-          reflection(bb[i]);
-          break;
+  /**
+   * Cut the particles into about blocks index blocks and sum up the
+   * estimated cost per block into _block_cost (a prefix sum). Returns the
+   * block length.
+   */
+  size_t block_costs(size_t blocks) {
+    const size_t n = _particles.size();
+    const size_t block = std::max<size_t>(1, (n + blocks - 1) / blocks);
+    blocks = (n + block - 1) / block;
+    _block_cost.assign(blocks + 1, 0);
+    const Space2D *position = _particles.position_data();
+    auto sum = [&](size_t beg, size_t end) {
+      for (size_t b = beg; b < end; ++b) {
+        double cost = 0;
+        for (size_t i = b * block; i < std::min(n, (b + 1) * block); ++i) {
+          cost += _cell_cost.particle(_grid.cell_of(position[i]));
         }
+        _block_cost[b + 1] = cost;
       }
     };
-    _thread_pool.push_loop(bb.size(), border_collision);
+    _thread_pool.push_loop(blocks, sum);
     _thread_pool.wait_for_tasks();
+    std::partial_sum(_block_cost.begin(), _block_cost.end(),
+                     _block_cost.begin());
+    return block;
+  }
 
-    auto move_boids = [this, &duration](int beg, int end) {
-      for (int i = beg; i < end; ++i) {
-        _particles.position_data()[i].x += _particles.velocity_data()[i].x * duration.count();
-        _particles.position_data()[i].y += _particles.velocity_data()[i].y * duration.count();
-        _particles.color_data()[i].x = 255; // (_particles.velocity_data()[i].x / _max_speed) * 255;
-        _particles.color_data()[i].y = 255; // (_particles.velocity_data()[i].y / _max_speed) * 255;
-        _particles.color_data()[i].z = 255;
-        _particles.color_data()[i].w = 255;
+  // copies the partition the move pass just touched; boids despawned in
+  // this step are still part of the version
+  void write_snapshot(size_t beg, size_t end) {
+    std::copy(_particles.position_data() + beg,
+              _particles.position_data() + end,
+              _snapshot->position.begin() + beg);
+    std::copy(_particles.velocity_data() + beg,
+              _particles.velocity_data() + end,
+              _snapshot->velocity.begin() + beg);
+    if (_particles.color_data() != nullptr) {
+      std::copy(_particles.color_data() + beg, _particles.color_data() + end,
+                _snapshot->color.begin() + beg);
+    } else {
+      for (size_t i = beg; i < end; ++i) {
+        _snapshot->color[i] = _particles.color(i);
       }
-    };
+    }
+    std::copy(_particles.species_data() + beg,
+              _particles.species_data() + end,
+              _snapshot->species.begin() + beg);
+  }
 
-    _thread_pool.push_loop(_particles.size(), move_boids);
-    _thread_pool.wait_for_tasks();
+  /**
+   * Runtime settings pick one of a few kernels that were instantiated at
+   * compile time, once per step. Inside the kernels, rules, weights and border
+   * handling are fixed, so there is no per-boid dispatch.
+   */
+  [[nodiscard]] RuleKernel select_rule_kernel() const {
+    if (_neighbor_lists) {
+      return select_rule_kernel<ListedNeighbors>();
+    }
+    if (_grid.packed()) {
+      return select_rule_kernel<PackedPrecision>();
+    }
+    return select_rule_kernel<FullPrecision>();
   }
 
-  cl_float2 separate(size_t index) {
-    cl_float2 steer{0, 0};
-    int count = 0;
-    int x = _particles.position_data()[index].x / _grid.grid_size();
-    int y = _particles.position_data()[index].y / _grid.grid_size();
-    for (int dx = -1; dx <= 1; ++dx) {
-      for (int dy = -1; dy <= 1; ++dy) {
-        int n_x = x + dx;
-        int n_y = y + dy;
-        if (n_x >= 0 && n_x < _grid.x_size() && n_y >= 0 &&
-            n_y < _grid.y_size()) {
-          for (size_t i : _grid.data()[n_x][n_y]) {
-            double distance = compute_dist(_particles.position_data()[index],
-                                           _particles.position_data()[i]);
-            if (distance > 0 && distance < _separation_radius) {
-              // Calculate the vector pointing away from other boids
-              double diffX = _particles.position_data()[index].x - _particles.position_data()[i].x;
-              double diffY = _particles.position_data()[index].y - _particles.position_data()[i].y;
-              diffX /= distance;
-              diffY /= distance;
-
-              steer.x += diffX;
-              steer.y += diffY;
-              ++count;
-            }
+  template <typename Neighbors>
+  [[nodiscard]] RuleKernel select_rule_kernel() const {
+    return _species.unit_weights()
+               ? &BoidsSimulation::apply_rule_set<UnitWeights, Neighbors,
+                                                  DefaultRules>
+               : &BoidsSimulation::apply_rule_set<SpeciesWeights, Neighbors,
+                                                  DefaultRules>;
+  }
+
+  [[nodiscard]] MoveKernel select_move_kernel() const {
+    switch (_integrator) {
+    case INTEGRATOR::SEMI_IMPLICIT_EULER:
+      return select_move_kernel<SemiImplicitEuler>();
+    case INTEGRATOR::VELOCITY_VERLET:
+      return select_move_kernel<VelocityVerlet>();
+    case INTEGRATOR::EULER:
+    default:
+      return select_move_kernel<ImpulseEuler>();
+    }
+  }
+
+  template <typename Integrator>
+  [[nodiscard]] MoveKernel select_move_kernel() const {
+    switch (_border) {
+    case BORDER::TOROIDAL:
+      return &BoidsSimulation::move<Integrator, ToroidalBorder>;
+    case BORDER::REFLECTIVE:
+    default:
+      return &BoidsSimulation::move<Integrator, ReflectiveBorder>;
+    }
+  }
+
+  template <typename Weights, typename Neighbors, typename Set>
+  void apply_rule_set(size_t beg, size_t end) {
+    [&]<typename... Rules>(RuleSet<Rules...>) {
+      apply_rules<Weights, Neighbors, Rules...>(beg, end);
+    }(Set{});
+  }
+
+  /**
+   * All rules of the set are fed by a single neighbor scan per boid. beg and
+   * end index _rule_order if it is set, the particles otherwise.
+   */
+  template <typename Weights, typename Neighbors, typename... Rules>
+  void apply_rules(size_t beg, size_t end) {
+    Space2D *position = _particles.position_data();
+    Space2D *velocity = _particles.velocity_data();
+    const SpeciesId *species = _particles.species_data();
+    const bool lod = _lod_enabled;
+    const bool deferred = _integrator != INTEGRATOR::EULER;
+    std::optional<FlockAnalytics<Space2D>::Partial> stats;
+    if (_analytics_enabled) {
+      stats.emplace(_analytics.partial());
+    }
+    const ParticleIndex *order = _rule_order;
+    for (size_t k = beg; k < end; ++k) {
+      const size_t i = order != nullptr ? order[k] : k;
+      const SpeciesParameters &sp = _species[species[i]];
+      const Space2D self = position[i];
+      std::tuple<typename Rules::State...> states{Rules::init(sp)...};
+      // obstacles and predators are avoided in every tier
+      cl_float2 steer = avoid(i);
+      const float rate = lod ? _lod.scale(_grid.cell_of(self)) : 1.f;
+      float nearest = std::numeric_limits<float>::infinity();
+      if (rate > 0) {
+        for_each_neighbor<Neighbors>(i, [&](const Space2D &other,
+                                            const Space2D &other_velocity,
+                                            float weight) {
+          float distance = compute_dist(self, other);
+          if (distance > 0) {
+            nearest = std::min(nearest, distance);
+            std::apply(
+                [&](auto &...state) {
+                  (Rules::accumulate(state, self, other, other_velocity,
+                                     distance, weight),
+                   ...);
+                },
+                states);
           }
+        });
+
+        if (_far_field_weight > 0) {
+          add_weighted(steer,
+                       normalized(_far_field.attraction(
+                           self, i, _far_field_theta, sp.cohesion_radius)),
+                       _far_field_weight * rate);
         }
+        std::apply(
+            [&](const auto &...state) {
+              ((add_weighted(steer, Rules::finish(state, self),
+                             Weights::template weight<Rules>(sp) * rate)),
+               ...);
+            },
+            states);
       }
+
+      if (deferred) {
+        // neighbors keep reading the velocities of the last step
+        _acceleration[i] = {steer.x * _steering_rate,
+                            steer.y * _steering_rate};
+      } else {
+        velocity[i].x += steer.x;
+        velocity[i].y += steer.y;
+        clamp_speed(velocity[i], sp.max_speed);
+      }
+      if (stats) {
+        stats->add_velocity(velocity[i]);
+        if (rate > 0) {
+          stats->add_nearest(nearest);
+        }
+      }
+    }
+    if (stats) {
+      _analytics.merge(*stats);
     }
-    if (count > 0) {
-      steer.x /= count;
-      steer.y /= count;
-      double steerLength = std::sqrt(steer.x * steer.x + steer.y * steer.y);
-      if (steerLength > 0) {
-        steer.x /= steerLength;
-        steer.y /= steerLength;
+  }
+
+  template <typename Integrator, typename Border>
+  void move(size_t beg, size_t end, float dt) {
+    Space2D *position = _particles.position_data();
+    Space2D *velocity = _particles.velocity_data();
+    const Space2D *acceleration = _acceleration.data();
+    const Space2D *previous = _previous_acceleration_valid
+                                  ? _previous_acceleration.data()
+                                  : acceleration;
+    const float previous_dt = _previous_dt;
+    const SpeciesId *species = _particles.species_data();
+    cl_int4 *color = _particles.color_data();
+    for (size_t i = beg; i < end; ++i) {
+      if constexpr (Integrator::deferred) {
+        Integrator::integrate(position[i], velocity[i], acceleration[i],
+                              previous[i], _species[species[i]].max_speed, dt,
+                              previous_dt);
+      } else {
+        Integrator::integrate(position[i], velocity[i], {}, {}, 0, dt, 0);
+      }
+      Border::apply(position[i], velocity[i], _space);
+      if (color != nullptr) {
+        color[i] = _species[species[i]].color;
       }
     }
-    return steer;
   }
 
-  cl_float2 align(size_t index) {
-    cl_float2 average{0, 0};
-    int count = 0;
-    int x = _particles.position_data()[index].x / _grid.grid_size();
-    int y = _particles.position_data()[index].y / _grid.grid_size();
+  [[nodiscard]] std::vector<cl_int4> species_palette() const {
+    std::vector<cl_int4> palette(_species.size());
+    for (size_t s = 0; s < palette.size(); ++s) {
+      palette[s] = _species[static_cast<SpeciesId>(s)].color;
+    }
+    return palette;
+  }
+
+  static void add_weighted(cl_float2 &sum, cl_float2 v, float weight) {
+    sum.x += v.x * weight;
+    sum.y += v.y * weight;
+  }
+
+  /**
+   * Call f(position, velocity, weight) for every particle in the 3x3 cell
+   * block around index, or in its Verlet list. weight is 1 if the species of
+   * index reacts to the species of the neighbor and 0 otherwise, so callers
+   * can accumulate without branching on the species. With species buckets
+   * and Verlet lists, ignored species are not visited.
+   */
+  template <typename Neighbors, typename F>
+  void for_each_neighbor(size_t index, F &&f) {
+    const uint32_t mask = _species.mask(_particles.species_data()[index]);
+    const SpeciesId *species = _particles.species_data();
+    const Space2D *position = _particles.position_data();
+    const Space2D *velocity = _particles.velocity_data();
+    if constexpr (Neighbors::listed) {
+      for (const uint32_t *j = _neighbor_list.begin(index),
+                          *last = _neighbor_list.end(index);
+           j != last; ++j) {
+        f(position[*j], velocity[*j], 1.f);
+      }
+      return;
+    }
+    const bool bucketed = _grid.species_buckets() > 0;
+    cl_int2 cell = _grid.cell_of(_particles.position_data()[index]);
+    int x = cell.x;
+    int y = cell.y;
     for (int dx = -1; dx <= 1; ++dx) {
       for (int dy = -1; dy <= 1; ++dy) {
         int n_x = x + dx;
         int n_y = y + dy;
         if (n_x >= 0 && n_x < _grid.x_size() && n_y >= 0 &&
             n_y < _grid.y_size()) {
-          for (size_t i : _grid.data()[n_x][n_y]) {
-            double distance = compute_dist(_particles.position_data()[index], _particles.position_data()[i]);
-            if (distance > 0 && distance < _alignment_radius) {
-              average.x += _particles.velocity_data()[i].x;
-              average.y += _particles.velocity_data()[i].y;
-              ++count;
+          if constexpr (Neighbors::packed) {
+            auto visit = [&](std::span<const PackedParticle> cell,
+                             bool masked) {
+              for (const PackedParticle &p : cell) {
+                // the quantized copy of index itself is not at distance 0
+                if (p.index == index) {
+                  continue;
+                }
+                const float weight =
+                    masked ? static_cast<float>((mask >> species[p.index]) & 1u)
+                           : 1.f;
+                if (p.x == PackedParticle::exact) {
+                  f(position[p.index], velocity[p.index], weight);
+                } else {
+                  f(_grid.unpack_position(p, n_x, n_y),
+                    _grid.unpack_velocity(p), weight);
+                }
+              }
+            };
+            if (bucketed) {
+              for (uint32_t m = mask; m != 0; m &= m - 1) {
+                auto other = static_cast<SpeciesId>(std::countr_zero(m));
+                visit(_grid.packed_data(other)[n_x][n_y], false);
+              }
+            } else {
+              visit(_grid.packed_data()[n_x][n_y], true);
+            }
+          } else if (bucketed) {
+            for (uint32_t m = mask; m != 0; m &= m - 1) {
+              auto other = static_cast<SpeciesId>(std::countr_zero(m));
+              for (size_t i : _grid.data(other)[n_x][n_y]) {
+                f(position[i], velocity[i], 1.f);
+              }
+            }
+          } else {
+            for (size_t i : _grid.data()[n_x][n_y]) {
+              f(position[i], velocity[i],
+                static_cast<float>((mask >> species[i]) & 1u));
             }
           }
         }
       }
     }
-    if (count > 0) {
-      average.x /= count;
-      average.y /= count;
-      double averageLength = std::sqrt(average.x * average.x + average.y * average.y);
-      if (averageLength > 0) {
-        average.x /= averageLength;
-        average.y /= averageLength;
-      }
-    }
-    return average;
   }
 
-  cl_float2 cohere(size_t index) {
-    cl_float2 center{0, 0};
+  /**
+   * Steering away from obstacles (sampled from the distance field) and from
+   * predators within _predator_radius. Both are part of the per-boid rule pass.
+   */
+  cl_float2 avoid(size_t index) {
     cl_float2 steer{0, 0};
-    int count = 0;
-
-    int x = _particles.position_data()[index].x / _grid.grid_size();
-    int y = _particles.position_data()[index].y / _grid.grid_size();
-    for (int dx = -1; dx <= 1; ++dx) {
-      for (int dy = -1; dy <= 1; ++dy) {
-        int n_x = x + dx;
-        int n_y = y + dy;
-        if (n_x >= 0 && n_x < _grid.x_size() && n_y >= 0 &&
-            n_y < _grid.y_size()) {
-          for (size_t i : _grid.data()[n_x][n_y]) {
-            double distance = compute_dist(_particles.position_data()[index], _particles.position_data()[i]);
-            if (distance > 0 && distance < _cohesion_radius) {
-              center.x += _particles.position_data()[i].x;
-              center.y += _particles.position_data()[i].y;
-              ++count;
+    const Space2D &position = _particles.position_data()[index];
+    if (!_obstacles.empty()) {
+      Space2D gradient;
+      float distance = _obstacles.sample(position, gradient);
+      if (distance < _obstacle_radius) {
+        float length = std::sqrt(gradient.x * gradient.x + gradient.y * gradient.y);
+        if (length > 0) {
+          // grows from 0 at _obstacle_radius to _obstacle_weight at the surface
+          float strength = _obstacle_weight * std::min(1.f, 1.f - distance / _obstacle_radius);
+          steer.x += gradient.x / length * strength;
+          steer.y += gradient.y / length * strength;
+        }
+      }
+    }
+    if (_predators.size() > 0) {
+      cl_float2 flee{0, 0};
+      cl_int2 cell = _grid.cell_of(position);
+      int reach = static_cast<int>(std::ceil(_predator_radius / _grid.grid_size()));
+      for (int n_x = std::max(0, cell.x - reach); n_x <= std::min<int>(_grid.x_size() - 1, cell.x + reach); ++n_x) {
+        for (int n_y = std::max(0, cell.y - reach); n_y <= std::min<int>(_grid.y_size() - 1, cell.y + reach); ++n_y) {
+          for (size_t p : _grid.predator_data()[n_x][n_y]) {
+            float distance = compute_dist(position, _predators.position_data()[p]);
+            if (distance > 0 && distance < _predator_radius) {
+              flee.x += (position.x - _predators.position_data()[p].x) / distance;
+              flee.y += (position.y - _predators.position_data()[p].y) / distance;
             }
           }
         }
       }
+      float length = std::sqrt(flee.x * flee.x + flee.y * flee.y);
+      if (length > 0) {
+        steer.x += flee.x / length * _flee_weight;
+        steer.y += flee.y / length * _flee_weight;
+      }
     }
-    if (count > 0) {
-      center.x /= count;
-      center.y /= count;
-
-      steer.x = center.x - _particles.position_data()[index].x;
-      steer.y = center.y - _particles.position_data()[index].y;
+    return steer;
+  }
 
-      double steerLength = std::sqrt(steer.x * steer.x + steer.y * steer.y);
-      if (steerLength > 0) {
-        steer.x /= steerLength;
-        steer.y /= steerLength;
+  /// predators are few, they chase the center of nearby boids serially
+  void updatePredators(Duration duration) {
+    const auto dt = static_cast<float>(duration.count());
+    int reach = static_cast<int>(std::ceil(_predator_radius / _grid.grid_size()));
+    for (size_t p = 0; p < _predators.size(); ++p) {
+      Space2D &position = _predators.position_data()[p];
+      Space2D &velocity = _predators.velocity_data()[p];
+      cl_float2 center{0, 0};
+      int count = 0;
+      cl_int2 cell = _grid.cell_of(position);
+      for (int n_x = std::max(0, cell.x - reach); n_x <= std::min<int>(_grid.x_size() - 1, cell.x + reach); ++n_x) {
+        for (int n_y = std::max(0, cell.y - reach); n_y <= std::min<int>(_grid.y_size() - 1, cell.y + reach); ++n_y) {
+          for (size_t i : _grid.data()[n_x][n_y]) {
+            center.x += _particles.position_data()[i].x;
+            center.y += _particles.position_data()[i].y;
+            ++count;
+          }
+        }
+      }
+      if (count > 0) {
+        float dx = center.x / count - position.x;
+        float dy = center.y / count - position.y;
+        float length = std::sqrt(dx * dx + dy * dy);
+        if (length > 0) {
+          velocity.x += dx / length;
+          velocity.y += dy / length;
+        }
+      }
+      float speed = std::sqrt(velocity.x * velocity.x + velocity.y * velocity.y);
+      if (speed > _predator_max_speed) {
+        velocity.x = velocity.x / speed * _predator_max_speed;
+        velocity.y = velocity.y / speed * _predator_max_speed;
       }
+      position.x += velocity.x * dt;
+      position.y += velocity.y * dt;
+      ReflectiveBorder::apply(position, velocity, _space);
     }
-    return steer;
   }
 
   static float compute_dist(cl_float2 a, cl_float2 b) {
@@ -210,33 +862,54 @@ private:
     return std::sqrt(diff.x * diff.x + diff.y * diff.y);
   }
 
-  
-  void reflection(size_t index) {
-    if ((_particles.position_data()[index].x <= _space.position.x && _particles.velocity_data()[index].x < 0) ||
-        (_particles.position_data()[index].x >= _space.position.x + _space.width() && _particles.velocity_data()[index].x > 0)) {
-      _particles.velocity_data()[index].x *= -1;
-    }
-    if ((_particles.position_data()[index].y <= _space.position.y && _particles.velocity_data()[index].y < 0) ||
-        (_particles.position_data()[index].y >= _space.position.y + _space.height() && _particles.velocity_data()[index].y > 0)) {
-      _particles.velocity_data()[index].y *= -1;
-    }
-  }
+  SpeciesTable _species;
+  /// the species changed since the palette was last built
+  bool _palette_stale{false};
+  std::atomic<SpeciesTable *> _published_species{nullptr};
+  size_t _species_updates{0};
+  bool _bucket_species{false};
+  bool _packed_neighbors{false};
+  bool _neighbor_lists{false};
+  NeighborList<Space2D> _neighbor_list;
 
-  void toroid(size_t index) {
-    if (_particles.position_data()[index].x <= _space.position.x && _particles.velocity_data()[index].x < 0) {
-      _particles.position_data()[index].x = _space.position.x;
-    } else if (_particles.position_data()[index].x >= _space.position.x + _space.width() && _particles.velocity_data()[index].x > 0) {
-      _particles.position_data()[index].x = _space.position.x + _space.width();
-    }
-    if (_particles.position_data()[index].y <= _space.position.y && _particles.velocity_data()[index].y < 0) {
-      _particles.position_data()[index].y = _space.position.y + _space.height();
-    } else if (_particles.position_data()[index].y >= _space.position.y + _space.height() && _particles.velocity_data()[index].y > 0) {
-      _particles.position_data()[index].y = _space.position.y;
-    }
-  }
+  bool _lod_enabled{false};
+  LodScheduler<Space2D> _lod;
+
+  bool _analytics_enabled{false};
+  FlockAnalytics<Space2D> _analytics;
+
+  bool _tiled_rules{false};
+  CellTiles<Space2D> _tiles;
+  const ParticleIndex *_rule_order{nullptr};
+
+  bool _load_balancing{false};
+  CellCost<Space2D> _cell_cost;
+  std::vector<double> _block_cost;
+  std::vector<WorkChunk> _rule_chunks;
+
+  INTEGRATOR _integrator{INTEGRATOR::EULER};
+  float _steering_rate{60};
+  std::vector<Space2D> _acceleration;
+  std::vector<Space2D> _previous_acceleration;
+  bool _previous_acceleration_valid{false};
+  uint64_t _acceleration_layout{0};
+  float _previous_dt{0};
+
+  bool _adaptive_timestep{false};
+  float _courant{0.5f};
+  size_t _max_substeps{8};
+  size_t _substeps{1};
+
+  QuadTree<Space2D> _far_field;
+  float _far_field_weight{0};
+  float _far_field_theta{0.5f};
+
+  SignedDistanceField<Space2D> _obstacles;
+  float _obstacle_radius{20};
+  float _obstacle_weight{2};
 
-  float _separation_radius{10};
-  float _alignment_radius{30};
-  float _cohesion_radius{30};
-  float _max_speed{100};
+  Particles<Space2D> _predators{};
+  float _predator_radius{40};
+  float _predator_max_speed{120};
+  float _flee_weight{2};
 };
\ No newline at end of file
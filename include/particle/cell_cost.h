@@ -0,0 +1,67 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <particle/grid.h>
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+template <Dimension S> class CellCost {};
+
+/**
+ * Estimated rule pass work per grid cell: every particle of a cell scans the
+ * particles of the 3x3 block around it, so a particle costs the block
+ * occupancy and a cell costs its occupancy times that. Computed from the
+ * grid right after its update, before the rule pass reads it.
+ */
+template <> class CellCost<Space2D> {
+public:
+  void update(Grid<Space2D> &grid, BS::thread_pool &pool) {
+    _y_size = grid.y_size();
+    _block.resize(grid.x_size() * grid.y_size());
+    auto sum = [&](size_t beg, size_t end) {
+      for (size_t x = beg; x < end; ++x) {
+        for (size_t y = 0; y < grid.y_size(); ++y) {
+          uint32_t n = 0;
+          for (size_t n_x = x > 0 ? x - 1 : 0;
+               n_x <= std::min(x + 1, grid.x_size() - 1); ++n_x) {
+            for (size_t n_y = y > 0 ? y - 1 : 0;
+                 n_y <= std::min(y + 1, grid.y_size() - 1); ++n_y) {
+              n += static_cast<uint32_t>(grid.data()[n_x][n_y].size());
+            }
+          }
+          _block[x * _y_size + y] = n;
+        }
+      }
+    };
+    pool.push_loop(grid.x_size(), sum);
+    pool.wait_for_tasks();
+  }
+
+  /// neighbor candidates a particle in cell scans
+  [[nodiscard]] double particle(cl_int2 cell) const {
+    return _block[cell.x * _y_size + cell.y];
+  }
+
+  /// all particles of the cell together
+  [[nodiscard]] double cell(Grid<Space2D> &grid, size_t x, size_t y) const {
+    return static_cast<double>(grid.data()[x][y].size()) *
+           _block[x * _y_size + y];
+  }
+
+  [[nodiscard]] size_t memory_usage() const { return vector_bytes(_block); }
+
+private:
+  size_t _y_size{0};
+  std::vector<uint32_t> _block;
+};
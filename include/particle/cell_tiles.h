@@ -0,0 +1,223 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include <particle/cell_cost.h>
+#include <particle/grid.h>
+#include <particle/species.h>
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+/// size of the L2 cache of the first CPU, 1 MiB if it can not be detected
+inline size_t l2_cache_bytes() {
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+  long bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (bytes > 0) {
+    return static_cast<size_t>(bytes);
+  }
+#endif
+  return size_t{1} << 20;
+}
+
+/// position of (x, y) along the Hilbert curve filling an n x n square
+inline uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+  uint64_t d = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    const uint32_t rx = (x & s) > 0 ? 1 : 0;
+    const uint32_t ry = (y & s) > 0 ? 1 : 0;
+    d += uint64_t{s} * s * ((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+template <Dimension S> class CellTiles {};
+
+/**
+ * Square tiles of grid cells, visited along a Hilbert curve, and the
+ * particles of every tile listed cell by cell. A worker that processes the
+ * particles of one tile keeps reading the same few cells and their halo, so
+ * the neighbor data stays in cache; consecutive tiles are spatial neighbors,
+ * so a run of tiles is compact as well. The tile side is chosen per build
+ * such that a tile with its one-cell halo holds about half the L2 cache
+ * worth of particles at the average occupancy.
+ *
+ * Work is handed out in runs of cells in this order, cell c being
+ * order()[offset(c)] .. order()[offset(c + 1) - 1], so a run may start or
+ * end inside a tile.
+ */
+template <> class CellTiles<Space2D> {
+public:
+  /// bytes of neighbor data a scan reads per particle
+  static constexpr size_t particle_bytes =
+      2 * sizeof(Space2D) + sizeof(SpeciesId) + sizeof(ParticleIndex);
+
+  explicit CellTiles(size_t cache_bytes = l2_cache_bytes())
+      : _cache_bytes(cache_bytes) {}
+
+  void set_cache_bytes(size_t bytes) { _cache_bytes = bytes; }
+  [[nodiscard]] size_t cache_bytes() const { return _cache_bytes; }
+
+  /**
+   * List the particles 0..size of grid tile by tile. Cells may also hold
+   * ghosts (indices from size on), those are left out. With cost, the
+   * estimated cost of the cells is summed up as well.
+   */
+  void build(Grid<Space2D> &grid, size_t size, BS::thread_pool &pool,
+             const CellCost<Space2D> *cost = nullptr) {
+    const size_t cells = grid.x_size() * grid.y_size();
+    const double occupancy =
+        cells > 0 ? static_cast<double>(size) / static_cast<double>(cells) : 0;
+    const double halo_cells =
+        static_cast<double>(_cache_bytes) / 2 /
+        std::max(occupancy * particle_bytes, 1.0);
+    const auto side = static_cast<size_t>(
+        std::max(1.0, std::floor(std::sqrt(halo_cells)) - 2));
+    layout(grid.x_size(), grid.y_size(), side);
+
+    // particles per cell, then their offsets, then the lists
+    _cost.assign(cost != nullptr ? cells + 1 : 0, 0);
+    auto count = [&](size_t beg, size_t end) {
+      for (size_t t = beg; t < end; ++t) {
+        size_t c = _first_cell[t];
+        for_each_cell(_tiles[t], [&](size_t x, size_t y) {
+          size_t n = 0;
+          for (ParticleIndex i : grid.data()[x][y]) {
+            n += i < size;
+          }
+          _offset[c + 1] = n;
+          if (cost != nullptr) {
+            _cost[c + 1] = cost->cell(grid, x, y);
+          }
+          ++c;
+        });
+      }
+    };
+    pool.push_loop(_tiles.size(), count);
+    pool.wait_for_tasks();
+    _offset[0] = 0;
+    std::partial_sum(_offset.begin(), _offset.end(), _offset.begin());
+    std::partial_sum(_cost.begin(), _cost.end(), _cost.begin());
+    _order.resize(_offset.back());
+    auto fill = [&](size_t beg, size_t end) {
+      for (size_t t = beg; t < end; ++t) {
+        size_t k = _offset[_first_cell[t]];
+        for_each_cell(_tiles[t], [&](size_t x, size_t y) {
+          for (ParticleIndex i : grid.data()[x][y]) {
+            if (i < size) {
+              _order[k++] = i;
+            }
+          }
+        });
+      }
+    };
+    pool.push_loop(_tiles.size(), fill);
+    pool.wait_for_tasks();
+  }
+
+  [[nodiscard]] size_t size() const { return _tiles.size(); }
+  /// tile side in cells
+  [[nodiscard]] size_t side() const { return _side; }
+
+  /// cells in tile order
+  [[nodiscard]] size_t cells() const { return _offset.size() - 1; }
+  [[nodiscard]] size_t offset(size_t cell) const { return _offset[cell]; }
+  [[nodiscard]] const ParticleIndex *order() const { return _order.data(); }
+
+  /// summed cost of the cells before c at index c, empty if built without
+  [[nodiscard]] const std::vector<double> &cost_prefix() const {
+    return _cost;
+  }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return vector_bytes(_tiles) + vector_bytes(_first_cell) +
+           vector_bytes(_offset) + vector_bytes(_order) + vector_bytes(_cost);
+  }
+
+private:
+  /// lower corner of a tile in cells
+  struct Tile {
+    uint32_t x;
+    uint32_t y;
+  };
+
+  /// tile corners along the Hilbert curve, only recomputed on changes
+  void layout(size_t x_size, size_t y_size, size_t side) {
+    if (x_size == _x_size && y_size == _y_size && side == _side) {
+      return;
+    }
+    _x_size = x_size;
+    _y_size = y_size;
+    _side = side;
+    const size_t tiles_x = (x_size + side - 1) / side;
+    const size_t tiles_y = (y_size + side - 1) / side;
+    uint32_t n = 1;
+    while (n < std::max(tiles_x, tiles_y)) {
+      n <<= 1;
+    }
+    std::vector<std::pair<uint64_t, Tile>> curve;
+    curve.reserve(tiles_x * tiles_y);
+    for (uint32_t x = 0; x < tiles_x; ++x) {
+      for (uint32_t y = 0; y < tiles_y; ++y) {
+        curve.push_back({hilbert_index(n, x, y),
+                         {static_cast<uint32_t>(x * side),
+                          static_cast<uint32_t>(y * side)}});
+      }
+    }
+    std::sort(curve.begin(), curve.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+    _tiles.clear();
+    _first_cell.clear();
+    size_t cells = 0;
+    for (const auto &c : curve) {
+      _tiles.push_back(c.second);
+      _first_cell.push_back(cells);
+      for_each_cell(c.second, [&](size_t, size_t) { ++cells; });
+    }
+    _offset.assign(cells + 1, 0);
+  }
+
+  /// f(x, y) for the cells of tile, in the order they are listed
+  template <typename F> void for_each_cell(const Tile &tile, F &&f) const {
+    const size_t x_end = std::min<size_t>(tile.x + _side, _x_size);
+    const size_t y_end = std::min<size_t>(tile.y + _side, _y_size);
+    for (size_t x = tile.x; x < x_end; ++x) {
+      for (size_t y = tile.y; y < y_end; ++y) {
+        f(x, y);
+      }
+    }
+  }
+
+  size_t _cache_bytes;
+  size_t _x_size{0};
+  size_t _y_size{0};
+  size_t _side{0};
+  std::vector<Tile> _tiles;
+  std::vector<size_t> _first_cell;
+  std::vector<size_t> _offset;
+  std::vector<ParticleIndex> _order;
+  std::vector<double> _cost;
+};
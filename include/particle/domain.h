@@ -0,0 +1,305 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <particle/grid.h>
+#include <particle/simulation.h>
+#include <particle/types.h>
+#include <particle/utils/shm.h>
+
+/**
+ * Splits a rectangular domain into tiles_x * tiles_y tiles. Each tile is owned
+ * by one process, halo is the width of the border region a tile mirrors from
+ * its neighbors (at least the largest interaction radius).
+ */
+struct Tiling {
+  Space domain;
+  int tiles_x{1};
+  int tiles_y{1};
+  int halo{0};
+
+  [[nodiscard]] int num_tiles() const { return tiles_x * tiles_y; }
+
+  [[nodiscard]] int rank(int tx, int ty) const { return ty * tiles_x + tx; }
+
+  [[nodiscard]] Space tile(int rank) const {
+    int tx = rank % tiles_x;
+    int ty = rank / tiles_x;
+    int x0 = start(tx, tiles_x, domain.position.x, domain.size.x);
+    int x1 = start(tx + 1, tiles_x, domain.position.x, domain.size.x);
+    int y0 = start(ty, tiles_y, domain.position.y, domain.size.y);
+    int y1 = start(ty + 1, tiles_y, domain.position.y, domain.size.y);
+    return {{x0, y0}, {x1 - x0, y1 - y0}};
+  }
+
+  /// tile extended by the halo on every side
+  [[nodiscard]] Space region(int rank) const {
+    Space t = tile(rank);
+    return {{t.position.x - halo, t.position.y - halo},
+            {t.size.x + 2 * halo, t.size.y + 2 * halo}};
+  }
+
+  /// tile owning position, positions outside the domain map to the edge tiles
+  [[nodiscard]] int tile_at(const Space2D &position) const {
+    return rank(index(position.x, tiles_x, domain.position.x, domain.size.x),
+                index(position.y, tiles_y, domain.position.y, domain.size.y));
+  }
+
+  [[nodiscard]] std::vector<int> neighbors(int rank) const {
+    std::vector<int> res;
+    int tx = rank % tiles_x;
+    int ty = rank / tiles_x;
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        int nx = tx + dx;
+        int ny = ty + dy;
+        if ((dx != 0 || dy != 0) && nx >= 0 && nx < tiles_x && ny >= 0 &&
+            ny < tiles_y) {
+          res.push_back(this->rank(nx, ny));
+        }
+      }
+    }
+    return res;
+  }
+
+  /// grid covering the tile and its halo
+  [[nodiscard]] Grid<Space2D> grid(int rank, size_t cell_size) const {
+    Space r = region(rank);
+    return {static_cast<size_t>(r.size.x), static_cast<size_t>(r.size.y),
+            cell_size, r.position};
+  }
+
+  static bool contains(const Space &space, const Space2D &position) {
+    return position.x >= space.position.x &&
+           position.x < space.position.x + space.size.x &&
+           position.y >= space.position.y &&
+           position.y < space.position.y + space.size.y;
+  }
+
+private:
+  static int start(int t, int n, int origin, int length) {
+    return origin + static_cast<int>(static_cast<long>(t) * length / n);
+  }
+
+  static int index(float v, int n, int origin, int length) {
+    int t = static_cast<int>((v - origin) * n / length);
+    t = std::clamp(t, 0, n - 1);
+    while (t > 0 && v < start(t, n, origin, length)) {
+      --t;
+    }
+    while (t < n - 1 && v >= start(t + 1, n, origin, length)) {
+      ++t;
+    }
+    return t;
+  }
+};
+
+template <Dimension S> struct ExchangeRecord {
+  enum Kind : uint32_t { HALO, MIGRATE, END_OF_STEP };
+
+  uint32_t kind;
+  uint32_t step;
+  S position;
+  S velocity;
+  SpeciesId species;
+};
+
+template <Dimension S> class TileExchange {};
+
+/**
+ * Per-process side of a tiled simulation. Before every update, boids that left
+ * the tile are handed to the neighbor in their direction, and boids within the
+ * halo of a neighbor are mirrored to it as ghosts. Each ordered pair of
+ * neighboring tiles is connected by one shared-memory ring, created by the
+ * receiving tile, so processes can be started in any order.
+ */
+template <> class TileExchange<Space2D> {
+  using Record = ExchangeRecord<Space2D>;
+
+public:
+  TileExchange(const std::string &session, Tiling tiling, int rank,
+               size_t capacity = 1 << 16,
+               std::chrono::milliseconds timeout = std::chrono::seconds(10))
+      : _tiling(tiling), _rank(rank), _tile(tiling.tile(rank)),
+        _timeout(timeout) {
+    for (int n : _tiling.neighbors(_rank)) {
+      Neighbor nb;
+      nb.rank = n;
+      nb.region = _tiling.region(n);
+      nb.in = ShmRing<Record>::create(channel(session, n, _rank), capacity);
+      _neighbors.push_back(std::move(nb));
+    }
+    for (auto &nb : _neighbors) {
+      nb.out = ShmRing<Record>::open(channel(session, _rank, nb.rank), timeout);
+    }
+  }
+
+  static std::string channel(const std::string &session, int from, int to) {
+    return "/" + session + "_" + std::to_string(from) + "_" +
+           std::to_string(to);
+  }
+
+  /**
+   * Exchange migrants and halo with all neighbors. Blocks until every
+   * neighbor has sent its part of the current step, throws if a neighbor
+   * does not make progress within the timeout.
+   */
+  void exchange(Simulation<Space2D> &sim) {
+    auto &particles = sim.particles();
+    _arrivals_position.clear();
+    _arrivals_velocity.clear();
+    _arrivals_species.clear();
+    _ghost_position.clear();
+    _ghost_velocity.clear();
+    _ghost_species.clear();
+    for (auto &nb : _neighbors) {
+      nb.done = false;
+    }
+    _last_progress = std::chrono::steady_clock::now();
+
+    // boids deeper inside the tile than the halo are not seen by anyone
+    const Space inner{{_tile.position.x + _tiling.halo,
+                       _tile.position.y + _tiling.halo},
+                      {_tile.size.x - 2 * _tiling.halo,
+                       _tile.size.y - 2 * _tiling.halo}};
+    for (size_t i = 0; i < particles.size(); ++i) {
+      const Space2D &position = particles.position_data()[i];
+      if (Tiling::contains(inner, position)) {
+        continue;
+      }
+      Record record{Record::HALO, _step, position,
+                    particles.velocity_data()[i],
+                    particles.species_data()[i]};
+      int owner = _tiling.tile_at(position);
+      if (owner != _rank) {
+        record.kind = Record::MIGRATE;
+        send(toward(owner), record);
+        particles.despawn_at(i);
+        ++_migrated_out;
+        continue;
+      }
+      for (auto &nb : _neighbors) {
+        if (Tiling::contains(nb.region, position)) {
+          send(nb, record);
+        }
+      }
+    }
+    for (auto &nb : _neighbors) {
+      send(nb, {Record::END_OF_STEP, _step, {}, {}, 0});
+    }
+    while (!std::all_of(_neighbors.begin(), _neighbors.end(),
+                        [](const Neighbor &nb) { return nb.done; })) {
+      wait_for_progress(poll());
+    }
+
+    sim.compact();
+    sim.spawn(_arrivals_position.size(), _arrivals_position.data(),
+              _arrivals_velocity.data(), nullptr, _arrivals_species.data());
+    particles.set_ghosts(_ghost_position.size(), _ghost_position.data(),
+                         _ghost_velocity.data(), _ghost_species.data());
+    _migrated_in += _arrivals_position.size();
+    ++_step;
+  }
+
+  [[nodiscard]] const Space &tile() const { return _tile; }
+  [[nodiscard]] size_t migrated_in() const { return _migrated_in; }
+  [[nodiscard]] size_t migrated_out() const { return _migrated_out; }
+
+private:
+  struct Neighbor {
+    int rank{0};
+    Space region{};
+    ShmRing<Record> out;
+    ShmRing<Record> in;
+    bool done{false};
+  };
+
+  // neighbor in the direction of a possibly non-adjacent tile, which forwards
+  // the boid further
+  Neighbor &toward(int rank) {
+    int dx = rank % _tiling.tiles_x - _rank % _tiling.tiles_x;
+    int dy = rank / _tiling.tiles_x - _rank / _tiling.tiles_x;
+    int next = _tiling.rank(_rank % _tiling.tiles_x + (dx > 0) - (dx < 0),
+                            _rank / _tiling.tiles_x + (dy > 0) - (dy < 0));
+    return *std::find_if(_neighbors.begin(), _neighbors.end(),
+                         [next](const Neighbor &nb) { return nb.rank == next; });
+  }
+
+  void send(Neighbor &nb, const Record &record) {
+    // keep draining our inputs while the output is full, otherwise two tiles
+    // sending to each other could block forever
+    while (!nb.out.try_push(record)) {
+      wait_for_progress(poll());
+    }
+  }
+
+  bool poll() {
+    bool progress = false;
+    Record record{};
+    for (auto &nb : _neighbors) {
+      while (!nb.done && nb.in.try_pop(record)) {
+        progress = true;
+        switch (record.kind) {
+        case Record::MIGRATE:
+          _arrivals_position.push_back(record.position);
+          _arrivals_velocity.push_back(record.velocity);
+          _arrivals_species.push_back(record.species);
+          break;
+        case Record::HALO:
+          _ghost_position.push_back(record.position);
+          _ghost_velocity.push_back(record.velocity);
+          _ghost_species.push_back(record.species);
+          break;
+        default:
+          nb.done = true;
+          break;
+        }
+      }
+    }
+    return progress;
+  }
+
+  void wait_for_progress(bool progress) {
+    auto now = std::chrono::steady_clock::now();
+    if (progress) {
+      _last_progress = now;
+    } else if (now - _last_progress > _timeout) {
+      throw std::runtime_error("tile " + std::to_string(_rank) +
+                               ": neighbor exchange timed out in step " +
+                               std::to_string(_step));
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  Tiling _tiling;
+  int _rank;
+  Space _tile;
+  std::chrono::milliseconds _timeout;
+  std::chrono::steady_clock::time_point _last_progress;
+
+  std::vector<Neighbor> _neighbors;
+  uint32_t _step{0};
+
+  std::vector<Space2D> _arrivals_position;
+  std::vector<Space2D> _arrivals_velocity;
+  std::vector<SpeciesId> _arrivals_species;
+  std::vector<Space2D> _ghost_position;
+  std::vector<Space2D> _ghost_velocity;
+  std::vector<SpeciesId> _ghost_species;
+
+  size_t _migrated_in{0};
+  size_t _migrated_out{0};
+};
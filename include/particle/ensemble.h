@@ -0,0 +1,175 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <particle/boids.h>
+#include <particle/species.h>
+#include <particle/types.h>
+#include <particle/utils/thread_pool.h>
+
+/// settings shared by all members of an ensemble, read-only while it runs
+struct EnsembleConfig {
+  size_t num_boids{1000};
+  size_t width{1000};
+  size_t height{1000};
+  size_t grid_size{30};
+  size_t steps{1000};
+  Duration dt{1.0 / 60.0};
+  BORDER border{BORDER::REFLECTIVE};
+  /// parameters not varied by the sweep
+  SpeciesParameters base{};
+};
+
+/**
+ * Cartesian product of values for the swept rule parameters. An empty axis
+ * keeps the value of the base parameters.
+ */
+struct ParameterSweep {
+  std::vector<float> separation_radius;
+  std::vector<float> alignment_radius;
+  std::vector<float> cohesion_radius;
+  std::vector<float> max_speed;
+
+  [[nodiscard]] size_t size() const {
+    return extent(separation_radius) * extent(alignment_radius) *
+           extent(cohesion_radius) * extent(max_speed);
+  }
+
+  /// parameters of point i, the last axis varies fastest
+  [[nodiscard]] SpeciesParameters at(size_t i,
+                                     const SpeciesParameters &base) const {
+    SpeciesParameters p = base;
+    i = pick(max_speed, i, p.max_speed);
+    i = pick(cohesion_radius, i, p.cohesion_radius);
+    i = pick(alignment_radius, i, p.alignment_radius);
+    pick(separation_radius, i, p.separation_radius);
+    return p;
+  }
+
+private:
+  static size_t extent(const std::vector<float> &axis) {
+    return axis.empty() ? 1 : axis.size();
+  }
+
+  static size_t pick(const std::vector<float> &axis, size_t i, float &value) {
+    if (axis.empty()) {
+      return i;
+    }
+    value = axis[i % axis.size()];
+    return i / axis.size();
+  }
+};
+
+/// summary of one member after its last step
+struct EnsembleResult {
+  SpeciesParameters parameters;
+  uint64_t seed{0};
+  /// length of the mean heading, 1 if all boids fly the same direction
+  float order{0};
+  float mean_speed{0};
+  double seconds{0};
+};
+
+template <Dimension S> class Ensemble {};
+
+/**
+ * Runs many small independent boids simulations side by side. Each member is
+ * a single task on the ensemble's pool and steps its own simulation with one
+ * worker from start to end, so a member never waits for other members and
+ * the cores stay busy as long as members are queued. Only one simulation per
+ * worker is alive at a time.
+ */
+template <> class Ensemble<Space2D> {
+public:
+  explicit Ensemble(EnsembleConfig config, uint num_threads = 0)
+      : _config(config), _thread_pool(num_threads) {}
+
+  [[nodiscard]] const EnsembleConfig &config() const { return _config; }
+
+  /// one member per point of the sweep and repetition, seeded seed, seed+1...
+  std::vector<EnsembleResult> run(const ParameterSweep &sweep,
+                                  size_t repetitions = 1, uint64_t seed = 0) {
+    std::vector<SpeciesParameters> members;
+    members.reserve(sweep.size() * repetitions);
+    for (size_t i = 0; i < sweep.size(); ++i) {
+      for (size_t r = 0; r < repetitions; ++r) {
+        members.push_back(sweep.at(i, _config.base));
+      }
+    }
+    return run(members, seed);
+  }
+
+  std::vector<EnsembleResult> run(const std::vector<SpeciesParameters> &members,
+                                  uint64_t seed = 0) {
+    std::vector<EnsembleResult> results(members.size());
+    auto run_members = [&](size_t beg, size_t end) {
+      for (size_t m = beg; m < end; ++m) {
+        results[m] = run_member(members[m], seed + m);
+      }
+    };
+    // one block per member: workers that finish early pick up the next one
+    _thread_pool.push_loop(members.size(), run_members, members.size());
+    _thread_pool.wait_for_tasks();
+    return results;
+  }
+
+  [[nodiscard]] uint num_threads() const {
+    return _thread_pool.get_thread_count();
+  }
+
+private:
+  EnsembleResult run_member(const SpeciesParameters &parameters,
+                            uint64_t seed) const {
+    auto start = std::chrono::steady_clock::now();
+    BoidsSimulation<Space2D> simulation(
+        _config.num_boids, {_config.width, _config.height, _config.grid_size},
+        1);
+    simulation.set_border(_config.border);
+    simulation.species()[0] = parameters;
+
+    const float v = parameters.max_speed;
+    simulation.randomize(
+        Distribution2D::uniform({0, 0}, {static_cast<float>(_config.width),
+                                         static_cast<float>(_config.height)}),
+        Distribution2D::uniform({-v, -v}, {v, v}), seed);
+    const auto &particles = simulation.particles();
+
+    for (size_t step = 0; step < _config.steps; ++step) {
+      simulation.update(_config.dt);
+    }
+
+    EnsembleResult result{parameters, seed};
+    Space2D heading{0, 0};
+    double speed = 0;
+    for (size_t i = 0; i < particles.size(); ++i) {
+      const Space2D &u = particles.velocity_data()[i];
+      float length = std::sqrt(u.x * u.x + u.y * u.y);
+      if (length > 0) {
+        heading.x += u.x / length;
+        heading.y += u.y / length;
+      }
+      speed += length;
+    }
+    if (particles.size() > 0) {
+      result.order = std::sqrt(heading.x * heading.x + heading.y * heading.y) /
+                     static_cast<float>(particles.size());
+      result.mean_speed = static_cast<float>(speed / particles.size());
+    }
+    result.seconds =
+        Duration(std::chrono::steady_clock::now() - start).count();
+    return result;
+  }
+
+  EnsembleConfig _config;
+  BS::thread_pool _thread_pool;
+};
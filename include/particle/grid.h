@@ -4,13 +4,129 @@
 
 #pragma once
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <numeric>
 #include <set>
+#include <span>
 #include <vector>
 
+#include <SDL.h>
+
 #include <particle/particle.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+/**
+ * Copy of a particle kept in its cell for compact neighbor scans: position as
+ * 16-bit fixed point relative to the cell, velocity as 16-bit fixed point
+ * relative to the grid's velocity scale. 12 bytes instead of an index plus
+ * two gathered float2. Particles that lie outside their cell (clamped into
+ * the outermost cells) or are faster than the scale are not quantized: x is
+ * exact and the scan reads them from the particle arrays.
+ */
+struct PackedParticle {
+  static constexpr uint16_t exact = 0xffff;
+
+  ParticleIndex index;
+  uint16_t x;
+  uint16_t y;
+  int16_t vx;
+  int16_t vy;
+};
+
+/**
+ * Entries of every cell of one grid layer, cell c = x * y_size + y. A rebuilt
+ * layer is flat: the entries sorted by cell (counting sort) and the offset of
+ * every cell, so a cell costs 4 bytes on top of its entries. A layer that is
+ * updated incrementally keeps one list per cell instead, so entries can be
+ * moved between cells in O(1).
+ */
+template <typename T> class CellLayer {
+public:
+  class Column {
+  public:
+    std::span<const T> operator[](size_t y) const {
+      return _layer.cell(_base + y);
+    }
+
+  private:
+    friend class CellLayer;
+    Column(const CellLayer &layer, size_t base) : _layer(layer), _base(base) {}
+
+    const CellLayer &_layer;
+    size_t _base;
+  };
+
+  CellLayer() = default;
+  CellLayer(size_t x_size, size_t y_size)
+      : _y_size(y_size), _cells(x_size * y_size), _offset(_cells + 1, 0) {}
+
+  /// layer[x][y] is the cell (x, y)
+  Column operator[](size_t x) const { return {*this, x * _y_size}; }
+
+  [[nodiscard]] std::span<const T> cell(size_t c) const {
+    if (!_lists.empty()) {
+      return _lists[c];
+    }
+    return {_items.data() + _offset[c], _offset[c + 1] - _offset[c]};
+  }
+
+  [[nodiscard]] size_t cells() const { return _cells; }
+
+  // flat rebuild: count every entry, then place them in the same order
+
+  void begin_count() {
+    _lists = {};
+    _offset.assign(_cells + 1, 0);
+  }
+
+  void count(size_t c) { ++_offset[c + 1]; }
+
+  void end_count() {
+    std::partial_sum(_offset.begin(), _offset.end(), _offset.begin());
+    _items.resize(_offset.back());
+  }
+
+  // _offset[c] serves as the insert position of cell c, which leaves it at
+  // the start of cell c + 1 once all entries are placed
+  void place(size_t c, const T &entry) { _items[_offset[c]++] = entry; }
+
+  void end_place() {
+    std::copy_backward(_offset.begin(), _offset.end() - 1, _offset.end());
+    _offset[0] = 0;
+  }
+
+  /// switch to one list per cell, all empty
+  void clear_lists() {
+    if (_lists.empty()) {
+      _offset = {};
+      _items = {};
+      _lists.resize(_cells);
+    }
+    for (auto &list : _lists) {
+      list.clear();
+    }
+  }
+
+  std::vector<T> &list(size_t c) { return _lists[c]; }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return vector_bytes(_offset) + vector_bytes(_items) + vector_bytes(_lists);
+  }
+
+private:
+  size_t _y_size{0};
+  size_t _cells{0};
+  std::vector<uint32_t> _offset;
+  std::vector<T> _items;
+  std::vector<std::vector<T>> _lists;
+};
 
 template <Dimension S> class Grid {};
 
@@ -18,77 +134,673 @@ template <> class Grid<Space2D> {
   template <Dimension> friend class BoidsSimulation;
 
 public:
-  Grid(size_t width, size_t height, size_t grid_size)
-      : _x_size(width / grid_size), _y_size(height / grid_size),
-        _grid_size(grid_size), _grid(_x_size) {
-    for (auto &row : _grid) {
-      row.resize(_y_size);
+  /**
+   * Grid of width x height (rounded down to full cells) with its lower corner
+   * at origin. Particles outside are clamped into the outermost cells.
+   */
+  Grid(size_t width, size_t height, size_t grid_size, cl_int2 origin = {0, 0})
+      : _width(width), _height(height), _grid_size(grid_size),
+        _x_size(width / grid_size), _y_size(height / grid_size),
+        _origin(origin), _grid(_x_size, _y_size) {}
+
+  /**
+   * Cut the area given at construction into cells of grid_size instead. All
+   * layers are reallocated and stay empty until the next update().
+   */
+  void set_grid_size(size_t grid_size) {
+    _grid_size = std::max<size_t>(1, std::min({grid_size, _width, _height}));
+    _x_size = _width / _grid_size;
+    _y_size = _height / _grid_size;
+    _grid = {_x_size, _y_size};
+    if (has_predators()) {
+      _predator_grid = {_x_size, _y_size};
     }
+    // also resets the packed layers and the incremental tracking
+    set_species_buckets(_species_grid.size());
   }
 
   void draw(SDL_Renderer *renderer) const {
-    int x = 0;
-    int y = 0;
+    int x = _origin.x;
+    int y = _origin.y;
     SDL_SetRenderDrawColor(renderer, 30, 30, 30, 10);
     for (int i = 0; i <= _x_size; ++i) {
-      SDL_RenderDrawLine(renderer, x, 0, x, _grid_size * _y_size);
+      SDL_RenderDrawLine(renderer, x, _origin.y, x,
+                         _origin.y + _grid_size * _y_size);
       x += _grid_size;
     }
     for (int i = 0; i <= _y_size; ++i) {
-      SDL_RenderDrawLine(renderer, 0, y, _grid_size * _x_size, y);
+      SDL_RenderDrawLine(renderer, _origin.x, y,
+                         _origin.x + _grid_size * _x_size, y);
       y += _grid_size;
     }
   }
 
+  /**
+   * Sort the particles into the cells. In incremental mode, only particles
+   * whose cell changed are moved between cells; see set_incremental().
+   */
   void update(const Particles<Space2D> &particles) {
-    for (auto &row : _grid) {
-      for (auto &col : row) {
-        col.clear();
+    if (_incremental && !packed() && &particles == _tracked &&
+        particles.layout_version() == _tracked_layout && migrate(particles)) {
+      return;
+    }
+    rebuild(particles);
+  }
+
+  /**
+   * Keep the cells between updates and only move the particles that changed
+   * their cell. Falls back to a full rebuild if the particle set changed
+   * (spawn, compaction, ghosts), if more than rebuild_fraction of the
+   * particles changed their cell in one step, or once resort_fraction of the
+   * particles have been moved since the last rebuild (the rebuild restores
+   * index order within the cells, which keeps neighbor gathers local).
+   * Packed copies change every step, so with set_packed() the grid is always
+   * rebuilt.
+   */
+  void set_incremental(bool enabled, float rebuild_fraction = 0.25f,
+                       float resort_fraction = 2.f) {
+    _incremental = enabled;
+    _rebuild_fraction = rebuild_fraction;
+    _resort_fraction = resort_fraction;
+    _tracked = nullptr;
+  }
+
+  [[nodiscard]] bool incremental() const { return _incremental; }
+
+  /// particles moved between cells by the last update, all of them on rebuild
+  [[nodiscard]] size_t last_moved() const { return _last_moved; }
+  [[nodiscard]] size_t rebuilds() const { return _rebuilds; }
+
+  /**
+   * Keep 16-bit fixed-point copies of the particles in their cells (see
+   * PackedParticle). velocity_scale is the largest speed that can be
+   * represented; 0 disables the packed copies.
+   */
+  void set_packed(float velocity_scale) {
+    _velocity_scale = velocity_scale;
+    // layer 0 mirrors the combined cells, layer s + 1 the cells of species s
+    size_t layers = velocity_scale > 0 ? 1 + _species_grid.size() : 0;
+    _packed_grid.assign(layers, {_x_size, _y_size});
+  }
+
+  [[nodiscard]] bool packed() const { return !_packed_grid.empty(); }
+  [[nodiscard]] float velocity_scale() const { return _velocity_scale; }
+
+  [[nodiscard]] Space2D unpack_position(const PackedParticle &p, int cell_x,
+                                        int cell_y) const {
+    const float scale = static_cast<float>(_grid_size) / 65536.f;
+    return {_origin.x + cell_x * static_cast<float>(_grid_size) + p.x * scale,
+            _origin.y + cell_y * static_cast<float>(_grid_size) + p.y * scale};
+  }
+
+  [[nodiscard]] Space2D unpack_velocity(const PackedParticle &p) const {
+    const float scale = _velocity_scale / 32767.f;
+    return {p.vx * scale, p.vy * scale};
+  }
+
+  /**
+   * Additionally keep one cell layer per species, so a neighbor scan can skip
+   * the cells of species it ignores. 0 disables the species layers.
+   */
+  void set_species_buckets(size_t num_species) {
+    _species_grid.assign(num_species, {_x_size, _y_size});
+    _tracked = nullptr;
+    if (packed()) {
+      set_packed(_velocity_scale);
+    }
+  }
+
+  [[nodiscard]] size_t species_buckets() const { return _species_grid.size(); }
+
+  /**
+   * Predators live in their own layer with the same cell geometry. The layer
+   * is only allocated while there are predators.
+   */
+  void update_predators(const Particles<Space2D> &predators) {
+    if (predators.size() == 0) {
+      _predator_grid = {};
+      return;
+    }
+    if (!has_predators()) {
+      _predator_grid = {_x_size, _y_size};
+    }
+    _predator_grid.begin_count();
+    for (size_t i = 0; i < predators.size(); ++i) {
+      _predator_grid.count(cell_id(cell_of(predators._position[i])));
+    }
+    _predator_grid.end_count();
+    for (size_t i = 0; i < predators.size(); ++i) {
+      _predator_grid.place(cell_id(cell_of(predators._position[i])),
+                           static_cast<ParticleIndex>(i));
+    }
+    _predator_grid.end_place();
+  }
+
+  /**
+   * Spatial queries against the cells of the last update(particles). They
+   * never allocate: results go to caller buffers, and the return value is
+   * the number of hits, which may exceed capacity (only the first capacity
+   * are written). Indices may refer to ghosts (>= particles.size()).
+   */
+  size_t query_box(const Particles<Space2D> &particles, const Space2D &min,
+                   const Space2D &max, size_t *out, size_t capacity) const {
+    const Space2D *position = particles.position_data();
+    size_t found = 0;
+    for_each_cell(cell_of(min), cell_of(max), [&](size_t i) {
+      if (position[i].x >= min.x && position[i].x <= max.x &&
+          position[i].y >= min.y && position[i].y <= max.y) {
+        if (found < capacity) {
+          out[found] = i;
+        }
+        ++found;
       }
+    });
+    return found;
+  }
+
+  size_t query_radius(const Particles<Space2D> &particles,
+                      const Space2D &center, float radius, size_t *out,
+                      size_t capacity) const {
+    const Space2D *position = particles.position_data();
+    const float radius_sq = radius * radius;
+    size_t found = 0;
+    for_each_cell(cell_of({center.x - radius, center.y - radius}),
+                  cell_of({center.x + radius, center.y + radius}),
+                  [&](size_t i) {
+                    float dx = position[i].x - center.x;
+                    float dy = position[i].y - center.y;
+                    if (dx * dx + dy * dy <= radius_sq) {
+                      if (found < capacity) {
+                        out[found] = i;
+                      }
+                      ++found;
+                    }
+                  });
+    return found;
+  }
+
+  /**
+   * The k particles nearest to point, closest first, with their distances.
+   * Searches rings of cells around point until no unvisited cell can hold a
+   * closer particle. Returns min(k, number of particles).
+   */
+  size_t query_nearest(const Particles<Space2D> &particles,
+                       const Space2D &point, size_t k, size_t *out,
+                       float *distance) const {
+    if (k == 0) {
+      return 0;
     }
-    for (size_t i = 0; i < particles.size(); ++i) {
-      size_t cell_x = particles._position[i].x / _grid_size;
-      size_t cell_y = particles._position[i].y / _grid_size;
-      if (cell_x >= _grid.size()) {
-        cell_x = _grid.size() - 1;
+    const Space2D *position = particles.position_data();
+    const cl_int2 center = cell_of(point);
+    size_t found = 0;
+    // out / distance hold the best found so far, sorted by distance
+    auto consider = [&](size_t i) {
+      float dx = position[i].x - point.x;
+      float dy = position[i].y - point.y;
+      float d = std::sqrt(dx * dx + dy * dy);
+      if (found == k && d >= distance[k - 1]) {
+        return;
+      }
+      size_t at = found < k ? found++ : k - 1;
+      for (; at > 0 && distance[at - 1] > d; --at) {
+        out[at] = out[at - 1];
+        distance[at] = distance[at - 1];
       }
-      if (cell_y >= _grid[cell_x].size()) {
-        cell_y = _grid[cell_x].size() - 1;
+      out[at] = i;
+      distance[at] = d;
+    };
+    const int max_ring = static_cast<int>(std::max(_x_size, _y_size));
+    for (int ring = 0; ring <= max_ring; ++ring) {
+      const cl_int2 lo{center.x - ring, center.y - ring};
+      const cl_int2 hi{center.x + ring, center.y + ring};
+      for (int x = std::max(lo.x, 0); x <= std::min<int>(hi.x, _x_size - 1);
+           ++x) {
+        for (int y = std::max(lo.y, 0); y <= std::min<int>(hi.y, _y_size - 1);
+             ++y) {
+          // only the border of the block is new in this ring
+          if (x == lo.x || x == hi.x || y == lo.y || y == hi.y) {
+            for (size_t i : _grid[x][y]) {
+              consider(i);
+            }
+          }
+        }
+      }
+      if (found == k && distance[k - 1] <= margin(point, lo, hi)) {
+        break;
       }
-      _grid[cell_x][cell_y].push_back(i);
     }
+    return found;
   }
 
-  [[nodiscard]] std::set<size_t> get_at_border() const {
-    std::set<size_t> res;
-    // top
-    for (const auto &i : _grid.front()) {
-      res.insert(i.begin(), i.end());
-    }
-    // bottom
-    for (const auto &i : _grid.back()) {
-      res.insert(i.begin(), i.end());
+  /**
+   * First particle within hit_radius of the ray origin + t * direction,
+   * 0 <= t <= max_t, direction normalized, origin inside the grid. Walks the
+   * cells along the ray.
+   * Returns false if there is none; otherwise hit and t are set.
+   */
+  bool query_ray(const Particles<Space2D> &particles, const Space2D &origin,
+                 const Space2D &direction, float max_t, float hit_radius,
+                 size_t &hit, float &t) const {
+    const Space2D *position = particles.position_data();
+    const float gs = static_cast<float>(_grid_size);
+    const int reach = static_cast<int>(std::ceil(hit_radius / gs));
+    // cells are visited at most once per step along the ray, a particle may
+    // be tested from several cells
+    float best = std::numeric_limits<float>::max();
+    auto test = [&](size_t i) {
+      float px = position[i].x - origin.x;
+      float py = position[i].y - origin.y;
+      float along = px * direction.x + py * direction.y;
+      float ox = px - along * direction.x;
+      float oy = py - along * direction.y;
+      if (along >= 0 && along <= max_t && along < best &&
+          ox * ox + oy * oy <= hit_radius * hit_radius) {
+        best = along;
+        hit = i;
+      }
+    };
+
+    cl_int2 cell = cell_of(origin);
+    const int step_x = direction.x > 0 ? 1 : -1;
+    const int step_y = direction.y > 0 ? 1 : -1;
+    const float inf = std::numeric_limits<float>::max();
+    auto boundary = [&](int c, int step, float o, float d, float origin_c) {
+      if (d == 0) {
+        return inf;
+      }
+      float edge = origin_c + (c + (step > 0 ? 1 : 0)) * gs;
+      return (edge - o) / d;
+    };
+    float next_x = boundary(cell.x, step_x, origin.x, direction.x, _origin.x);
+    float next_y = boundary(cell.y, step_y, origin.y, direction.y, _origin.y);
+    const float delta_x = direction.x != 0 ? gs / std::abs(direction.x) : inf;
+    const float delta_y = direction.y != 0 ? gs / std::abs(direction.y) : inf;
+    float entered = 0;
+    // a hit found in an earlier cell can only be beaten by a particle in a
+    // cell entered at most this much later
+    const float slack = (reach + 1) * gs * 1.5f;
+    while (entered <= max_t && entered <= best + slack &&
+           cell.x >= 0 && cell.x < static_cast<int>(_x_size) &&
+           cell.y >= 0 && cell.y < static_cast<int>(_y_size)) {
+      for_each_cell({cell.x - reach, cell.y - reach},
+                    {cell.x + reach, cell.y + reach}, test);
+      if (next_x < next_y) {
+        entered = next_x;
+        next_x += delta_x;
+        cell.x += step_x;
+      } else {
+        entered = next_y;
+        next_y += delta_y;
+        cell.y += step_y;
+      }
     }
-    // sides
-    for (auto &row : _grid) {
-      // left
-      res.insert(row.front().begin(), row.front().end());
-      // right
-      res.insert(row.back().begin(), row.back().end());
+    t = best;
+    return best != std::numeric_limits<float>::max();
+  }
+
+  /**
+   * query_radius for count centers in parallel. Query q writes up to
+   * capacity results to out + q * capacity and its hit count to found[q].
+   */
+  void query_radius(BS::thread_pool &pool, const Particles<Space2D> &particles,
+                    const Space2D *centers, size_t count, float radius,
+                    size_t *out, size_t capacity, size_t *found) const {
+    pool.push_loop(count, [&](size_t beg, size_t end) {
+      for (size_t q = beg; q < end; ++q) {
+        found[q] = query_radius(particles, centers[q], radius,
+                                out + q * capacity, capacity);
+      }
+    });
+    pool.wait_for_tasks();
+  }
+
+  /// query_nearest for count points in parallel, k results per point
+  void query_nearest(BS::thread_pool &pool,
+                     const Particles<Space2D> &particles,
+                     const Space2D *points, size_t count, size_t k,
+                     size_t *out, float *distance, size_t *found) const {
+    pool.push_loop(count, [&](size_t beg, size_t end) {
+      for (size_t q = beg; q < end; ++q) {
+        found[q] = query_nearest(particles, points[q], k, out + q * k,
+                                 distance + q * k);
+      }
+    });
+    pool.wait_for_tasks();
+  }
+
+  /// cell containing position, clamped to the grid
+  [[nodiscard]] cl_int2 cell_of(const Space2D &position) const {
+    return {clamp_cell(position.x - _origin.x, _x_size),
+            clamp_cell(position.y - _origin.y, _y_size)};
+  }
+
+  /**
+   * Particles in cells that contain or lie beyond the edges of space. If an
+   * edge is outside the grid, the outermost cells on that side are returned.
+   */
+  [[nodiscard]] std::set<size_t> get_at_border(const Space &space) const {
+    std::set<size_t> res;
+    cl_int2 low = cell_of({static_cast<float>(space.position.x),
+                           static_cast<float>(space.position.y)});
+    cl_int2 high = cell_of(
+        {static_cast<float>(space.position.x + space.width()),
+         static_cast<float>(space.position.y + space.height())});
+    for (int x = 0; x < static_cast<int>(_x_size); ++x) {
+      for (int y = 0; y < static_cast<int>(_y_size); ++y) {
+        if (x <= low.x || x >= high.x || y <= low.y || y >= high.y) {
+          res.insert(_grid[x][y].begin(), _grid[x][y].end());
+        }
+      }
     }
     return res;
   }
 
+  [[nodiscard]] std::set<size_t> get_at_border() const {
+    return get_at_border(extent());
+  }
+
+  /// area covered by the grid
+  [[nodiscard]] Space extent() const {
+    return {_origin,
+            {static_cast<int>(_x_size * _grid_size),
+             static_cast<int>(_y_size * _grid_size)}};
+  }
+
   [[nodiscard]] size_t grid_size() const { return _grid_size; }
 
   [[nodiscard]] size_t x_size() const { return _x_size; }
   [[nodiscard]] size_t y_size() const { return _y_size; }
 
-  std::vector<std::vector<size_t>> *data() { return _grid.data(); }
+  /// heap bytes of all cell layers and of the incremental tracking
+  [[nodiscard]] size_t memory_usage() const {
+    size_t bytes = _grid.memory_usage() + _predator_grid.memory_usage();
+    for (const auto &layer : _species_grid) {
+      bytes += layer.memory_usage();
+    }
+    for (const auto &layer : _packed_grid) {
+      bytes += layer.memory_usage();
+    }
+    return bytes + vector_bytes(_species_grid) + vector_bytes(_packed_grid) +
+           vector_bytes(_cell) + vector_bytes(_cell_slot) +
+           vector_bytes(_layer) + vector_bytes(_layer_slot) +
+           vector_bytes(_movers);
+  }
+
+  [[nodiscard]] const CellLayer<ParticleIndex> &data() const { return _grid; }
+  [[nodiscard]] const CellLayer<ParticleIndex> &data(SpeciesId species) const {
+    return _species_grid[species];
+  }
+  [[nodiscard]] const CellLayer<PackedParticle> &packed_data() const {
+    return _packed_grid[0];
+  }
+  [[nodiscard]] const CellLayer<PackedParticle> &
+  packed_data(SpeciesId species) const {
+    return _packed_grid[species + 1];
+  }
+  [[nodiscard]] bool has_predators() const {
+    return _predator_grid.cells() > 0;
+  }
+
+  [[nodiscard]] const CellLayer<ParticleIndex> &predator_data() const {
+    return _predator_grid;
+  }
 
 private:
+  /// f(i) for every particle in the cells lo..hi, clamped to the grid
+  template <typename F>
+  void for_each_cell(cl_int2 lo, cl_int2 hi, F &&f) const {
+    for (int x = std::max(lo.x, 0); x <= std::min<int>(hi.x, _x_size - 1);
+         ++x) {
+      for (int y = std::max(lo.y, 0); y <= std::min<int>(hi.y, _y_size - 1);
+           ++y) {
+        for (size_t i : _grid[x][y]) {
+          f(i);
+        }
+      }
+    }
+  }
+
+  /**
+   * Distance from point to the nearest particle outside the cell block
+   * lo..hi can not be smaller than this. Sides at the grid edge hold the
+   * clamped particles beyond it and do not count.
+   */
+  [[nodiscard]] float margin(const Space2D &point, cl_int2 lo,
+                             cl_int2 hi) const {
+    const float gs = static_cast<float>(_grid_size);
+    float m = std::numeric_limits<float>::max();
+    if (lo.x > 0) {
+      m = std::min(m, point.x - (_origin.x + lo.x * gs));
+    }
+    if (lo.y > 0) {
+      m = std::min(m, point.y - (_origin.y + lo.y * gs));
+    }
+    if (hi.x < static_cast<int>(_x_size) - 1) {
+      m = std::min(m, _origin.x + (hi.x + 1) * gs - point.x);
+    }
+    if (hi.y < static_cast<int>(_y_size) - 1) {
+      m = std::min(m, _origin.y + (hi.y + 1) * gs - point.y);
+    }
+    return m;
+  }
+
+  void rebuild(const Particles<Space2D> &particles) {
+    const bool track = _incremental && _packed_grid.empty();
+    if (track) {
+      rebuild_lists(particles);
+    } else {
+      rebuild_flat(particles);
+    }
+    _tracked = track ? &particles : nullptr;
+    _tracked_layout = particles.layout_version();
+    _moved_since_rebuild = 0;
+    _last_moved = particles.extent();
+    ++_rebuilds;
+  }
+
+  /**
+   * Counting sort of the particles into the flat layers: count per cell,
+   * then place them in index order, recomputing the cells instead of
+   * keeping them per particle.
+   */
+  void rebuild_flat(const Particles<Space2D> &particles) {
+    const bool bucketed = !_species_grid.empty();
+    const bool packed = !_packed_grid.empty();
+    const size_t n = particles.extent();
+    auto layer_of = [&](size_t i) -> size_t {
+      return bucketed ? bucket_of(particles._species[i]) : 0;
+    };
+    _cell = {};
+    _cell_slot = {};
+    _layer = {};
+    _layer_slot = {};
+    _grid.begin_count();
+    for (auto &layer : _species_grid) {
+      layer.begin_count();
+    }
+    for (auto &layer : _packed_grid) {
+      layer.begin_count();
+    }
+    // live particles and halo ghosts are both visible to neighbor queries
+    for (size_t i = 0; i < n; ++i) {
+      const uint32_t c = cell_id(cell_of(particles._position[i]));
+      _grid.count(c);
+      if (bucketed) {
+        _species_grid[layer_of(i)].count(c);
+      }
+      if (packed) {
+        _packed_grid[bucketed ? layer_of(i) + 1 : 0].count(c);
+      }
+    }
+    _grid.end_count();
+    for (auto &layer : _species_grid) {
+      layer.end_count();
+    }
+    for (auto &layer : _packed_grid) {
+      layer.end_count();
+    }
+    for (size_t i = 0; i < n; ++i) {
+      const cl_int2 cell = cell_of(particles._position[i]);
+      const uint32_t c = cell_id(cell);
+      _grid.place(c, static_cast<ParticleIndex>(i));
+      if (bucketed) {
+        _species_grid[layer_of(i)].place(c, static_cast<ParticleIndex>(i));
+      }
+      if (packed) {
+        _packed_grid[bucketed ? layer_of(i) + 1 : 0].place(
+            c, pack(i, cell, particles._position[i], particles._velocity[i]));
+      }
+    }
+    _grid.end_place();
+    for (auto &layer : _species_grid) {
+      layer.end_place();
+    }
+    for (auto &layer : _packed_grid) {
+      layer.end_place();
+    }
+  }
+
+  /// one list per cell and the cell and slot of every particle, see migrate()
+  void rebuild_lists(const Particles<Space2D> &particles) {
+    const bool bucketed = !_species_grid.empty();
+    const size_t n = particles.extent();
+    _grid.clear_lists();
+    for (auto &layer : _species_grid) {
+      layer.clear_lists();
+    }
+    _cell.resize(n);
+    _cell_slot.resize(n);
+    _layer.resize(n);
+    _layer_slot.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      _cell[i] = cell_id(cell_of(particles._position[i]));
+      link(_grid.list(_cell[i]), _cell_slot, static_cast<ParticleIndex>(i));
+      if (bucketed) {
+        _layer[i] = bucket_of(particles._species[i]);
+        link(_species_grid[_layer[i]].list(_cell[i]), _layer_slot,
+             static_cast<ParticleIndex>(i));
+      }
+    }
+  }
+
+  /**
+   * Move the particles whose cell (or species layer) changed since the last
+   * update. Returns false without touching the cells if so many particles
+   * moved that a rebuild is due.
+   */
+  bool migrate(const Particles<Space2D> &particles) {
+    const size_t n = particles.extent();
+    const bool bucketed = !_species_grid.empty();
+    _movers.clear();
+    for (size_t i = 0; i < n; ++i) {
+      if (cell_id(cell_of(particles._position[i])) != _cell[i] ||
+          (bucketed && bucket_of(particles._species[i]) != _layer[i])) {
+        _movers.push_back(static_cast<uint32_t>(i));
+      }
+    }
+    if (_movers.size() > _rebuild_fraction * n ||
+        _moved_since_rebuild + _movers.size() > _resort_fraction * n) {
+      return false;
+    }
+    for (uint32_t i : _movers) {
+      cl_int2 cell = cell_of(particles._position[i]);
+      unlink(_grid.list(_cell[i]), _cell_slot, i);
+      link(_grid.list(cell_id(cell)), _cell_slot, i);
+      if (bucketed) {
+        unlink(_species_grid[_layer[i]].list(_cell[i]), _layer_slot, i);
+        _layer[i] = bucket_of(particles._species[i]);
+        link(_species_grid[_layer[i]].list(cell_id(cell)), _layer_slot, i);
+      }
+      _cell[i] = cell_id(cell);
+    }
+    _moved_since_rebuild += _movers.size();
+    _last_moved = _movers.size();
+    return true;
+  }
+
+  // swap-remove index from its cell, fixing the slot of the particle moved
+  static void unlink(std::vector<ParticleIndex> &cell,
+                     std::vector<uint32_t> &slot, ParticleIndex index) {
+    const uint32_t at = slot[index];
+    cell[at] = cell.back();
+    slot[cell[at]] = at;
+    cell.pop_back();
+  }
+
+  static void link(std::vector<ParticleIndex> &cell,
+                   std::vector<uint32_t> &slot, ParticleIndex index) {
+    slot[index] = static_cast<uint32_t>(cell.size());
+    cell.push_back(index);
+  }
+
+  [[nodiscard]] uint32_t cell_id(cl_int2 cell) const {
+    return static_cast<uint32_t>(cell.x * _y_size + cell.y);
+  }
+
+  [[nodiscard]] SpeciesId bucket_of(SpeciesId species) const {
+    return static_cast<SpeciesId>(
+        std::min<size_t>(species, _species_grid.size() - 1));
+  }
+
+  [[nodiscard]] PackedParticle pack(size_t index, cl_int2 cell,
+                                    const Space2D &position,
+                                    const Space2D &velocity) const {
+    const float gs = static_cast<float>(_grid_size);
+    const float offset_x = position.x - _origin.x - cell.x * gs;
+    const float offset_y = position.y - _origin.y - cell.y * gs;
+    if (!(offset_x >= 0 && offset_x < gs && offset_y >= 0 && offset_y < gs &&
+          std::abs(velocity.x) <= _velocity_scale &&
+          std::abs(velocity.y) <= _velocity_scale)) {
+      return {static_cast<ParticleIndex>(index), PackedParticle::exact,
+              PackedParticle::exact, 0, 0};
+    }
+    // 65535 is left to PackedParticle::exact
+    auto fixed_offset = [gs](float offset) {
+      float v = offset / gs * 65536.f;
+      return static_cast<uint16_t>(std::clamp(v, 0.f, 65534.f));
+    };
+    auto fixed_velocity = [this](float v) {
+      float q = std::round(v / _velocity_scale * 32767.f);
+      return static_cast<int16_t>(std::clamp(q, -32767.f, 32767.f));
+    };
+    return {static_cast<ParticleIndex>(index), fixed_offset(offset_x),
+            fixed_offset(offset_y), fixed_velocity(velocity.x),
+            fixed_velocity(velocity.y)};
+  }
+
+  [[nodiscard]] int clamp_cell(float offset, size_t cells) const {
+    if (offset <= 0) {
+      return 0;
+    }
+    auto cell = static_cast<size_t>(offset / _grid_size);
+    return static_cast<int>(cell < cells ? cell : cells - 1);
+  }
+
+  size_t _width;
+  size_t _height;
   size_t _grid_size;
   size_t _x_size;
   size_t _y_size;
-  std::vector<std::vector<std::vector<size_t>>> _grid;
+  cl_int2 _origin;
+  CellLayer<ParticleIndex> _grid;
+  CellLayer<ParticleIndex> _predator_grid;
+  std::vector<CellLayer<ParticleIndex>> _species_grid;
+  std::vector<CellLayer<PackedParticle>> _packed_grid;
+  float _velocity_scale{0};
+
+  // incremental mode: cell and slot in that cell of every tracked particle,
+  // and the same for its species layer
+  bool _incremental{false};
+  float _rebuild_fraction{0.25f};
+  float _resort_fraction{2.f};
+  const Particles<Space2D> *_tracked{nullptr};
+  uint64_t _tracked_layout{0};
+  std::vector<uint32_t> _cell;
+  std::vector<uint32_t> _cell_slot;
+  std::vector<SpeciesId> _layer;
+  std::vector<uint32_t> _layer_slot;
+  std::vector<uint32_t> _movers;
+  size_t _moved_since_rebuild{0};
+  size_t _last_moved{0};
+  size_t _rebuilds{0};
 };
\ No newline at end of file
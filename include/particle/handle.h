@@ -0,0 +1,112 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * Stable reference to a single particle. Particle indices change whenever the
+ * live range is compacted, a handle stays valid until the particle it refers
+ * to is despawned (its slot generation is bumped on release).
+ */
+struct ParticleHandle {
+  static constexpr uint32_t invalid_slot = std::numeric_limits<uint32_t>::max();
+
+  uint32_t slot{invalid_slot};
+  uint32_t generation{0};
+
+  [[nodiscard]] bool valid() const { return slot != invalid_slot; }
+
+  bool operator==(const ParticleHandle &other) const = default;
+};
+
+/**
+ * Maps handle slots to current particle indices. Slots are recycled through a
+ * free list, the generation counter makes stale handles detectable in O(1).
+ * All generations are 0 until the first release, so they are only stored
+ * from then on.
+ */
+class HandleTable {
+public:
+  static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+  ParticleHandle acquire(uint32_t index) {
+    uint32_t slot;
+    if (!_free.empty()) {
+      slot = _free.back();
+      _free.pop_back();
+      _index[slot] = index;
+    } else {
+      slot = static_cast<uint32_t>(_index.size());
+      _index.push_back(index);
+      if (!_generation.empty()) {
+        _generation.push_back(0);
+      }
+    }
+    return {slot, generation(slot)};
+  }
+
+  void release(uint32_t slot) {
+    if (_generation.empty()) {
+      _generation.reserve(_index.capacity());
+      _generation.resize(_index.size(), 0);
+    }
+    _index[slot] = npos;
+    ++_generation[slot];
+    _free.push_back(slot);
+  }
+
+  // slots are unique per particle, so concurrent relocations of different
+  // particles never touch the same entry.
+  void relocate(uint32_t slot, uint32_t index) { _index[slot] = index; }
+
+  [[nodiscard]] bool alive(ParticleHandle handle) const {
+    return handle.slot < _index.size() &&
+           generation(handle.slot) == handle.generation &&
+           _index[handle.slot] != npos;
+  }
+
+  [[nodiscard]] uint32_t index(ParticleHandle handle) const {
+    return alive(handle) ? _index[handle.slot] : npos;
+  }
+
+  [[nodiscard]] ParticleHandle handle(uint32_t slot) const {
+    return {slot, generation(slot)};
+  }
+
+  void reserve(size_t slots) {
+    _index.reserve(slots);
+    if (!_generation.empty()) {
+      _generation.reserve(slots);
+    }
+  }
+
+  void clear() {
+    _index.clear();
+    _generation.clear();
+    _free.clear();
+  }
+
+  [[nodiscard]] size_t slots() const { return _index.size(); }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return (_index.capacity() + _generation.capacity() + _free.capacity()) *
+           sizeof(uint32_t);
+  }
+
+private:
+  [[nodiscard]] uint32_t generation(uint32_t slot) const {
+    return _generation.empty() ? 0 : _generation[slot];
+  }
+
+  std::vector<uint32_t> _index;
+  std::vector<uint32_t> _generation;
+  std::vector<uint32_t> _free;
+};
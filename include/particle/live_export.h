@@ -0,0 +1,224 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include <particle/particle.h>
+#include <particle/snapshot.h>
+#include <particle/types.h>
+#include <particle/utils/shm.h>
+
+/**
+ * Frames of particle state in POSIX shared memory for visualizers in other
+ * processes. The memory holds a header (format, dimension, capacity, newest
+ * frame) and a ring of slots, each with positions, velocities and colors of
+ * up to capacity particles. Frame f goes to slot f % slots.
+ *
+ * Every slot is guarded by a seqlock: its sequence is odd while the producer
+ * writes it. The producer never waits for readers. A reader checks the
+ * sequence before and after looking at a slot and retries if it changed, so
+ * it can read in place at its own rate. It only has to retry if the
+ * producer laps the ring while it reads.
+ */
+template <Dimension S> class LiveExport {
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+public:
+  static constexpr uint32_t magic = 0x44494f42; // "BOID"
+
+  struct Header {
+    uint32_t magic;
+    uint32_t dimension;
+    uint64_t capacity;
+    uint64_t slots;
+    /// newest complete frame + 1, 0 before the first frame
+    alignas(64) std::atomic<uint64_t> frames;
+  };
+
+  struct Slot {
+    alignas(64) std::atomic<uint64_t> sequence;
+    uint64_t frame;
+    uint64_t count;
+  };
+
+  LiveExport() = default;
+
+  /// producer side; frames with more than capacity particles are cut off
+  static LiveExport create(const std::string &name, size_t capacity,
+                           size_t slots = 3) {
+    slots = std::max<size_t>(slots, 2);
+    LiveExport e(SharedMemory::create(name, bytes(capacity, slots)));
+    e._header->dimension = dimension();
+    e._header->capacity = capacity;
+    e._header->slots = slots;
+    new (&e._header->frames) std::atomic<uint64_t>(0);
+    for (size_t s = 0; s < slots; ++s) {
+      new (e.slot(s)) Slot{{0}, 0, 0};
+    }
+    // magic is the ready word (see mark_ready), written last
+    mark_ready(e._header->magic, magic);
+    return e;
+  }
+
+  /// reader side, waits up to timeout for the producer to create it
+  static LiveExport open(const std::string &name,
+                         std::chrono::milliseconds timeout =
+                             std::chrono::milliseconds(5000)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    LiveExport e(SharedMemory::open(name, timeout));
+    if (e._shm.size() < sizeof(Header) ||
+        !wait_ready(e._header->magic, magic, deadline) ||
+        e._header->dimension != dimension() ||
+        e._shm.size() < bytes(e._header->capacity, e._header->slots)) {
+      throw std::runtime_error("LiveExport: '" + name +
+                               "' is not a live export of this dimension");
+    }
+    return e;
+  }
+
+  [[nodiscard]] size_t capacity() const { return _header->capacity; }
+  [[nodiscard]] size_t slots() const { return _header->slots; }
+
+  /// number of frames completed so far
+  [[nodiscard]] uint64_t frames() const {
+    return _header->frames.load(std::memory_order_acquire);
+  }
+
+  // producer: begin_frame, write the particle ranges (from any number of
+  // threads, ranges must not overlap), end_frame
+
+  void begin_frame(uint64_t frame, size_t count) {
+    _writing = slot(frame % slots());
+    _writing->sequence.store(_writing->sequence.load() + 1,
+                             std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _writing->frame = frame;
+    _writing->count = std::min<size_t>(count, capacity());
+  }
+
+  void write(size_t beg, size_t end, const Particles<S> &particles) {
+    end = std::min<size_t>(end, _writing->count);
+    if (beg >= end) {
+      return;
+    }
+    const size_t s = static_cast<size_t>(_writing - slot(0));
+    std::memcpy(positions(s) + beg, particles.position_data() + beg,
+                (end - beg) * sizeof(S));
+    std::memcpy(velocities(s) + beg, particles.velocity_data() + beg,
+                (end - beg) * sizeof(S));
+    for (size_t i = beg; i < end; ++i) {
+      colors(s)[i] = particles.color(i);
+    }
+  }
+
+  void end_frame() {
+    _writing->sequence.store(_writing->sequence.load(std::memory_order_relaxed) +
+                                 1,
+                             std::memory_order_release);
+    _header->frames.store(_writing->frame + 1, std::memory_order_release);
+    _writing = nullptr;
+  }
+
+  /**
+   * f(frame, count, positions, velocities, colors) on the newest frame, in
+   * place. Returns false if there is no frame yet or if the producer started
+   * overwriting the slot before f returned; then whatever f read must be
+   * discarded (call again).
+   */
+  template <typename F> bool view(F &&f) const {
+    const uint64_t frames = this->frames();
+    if (frames == 0) {
+      return false;
+    }
+    const size_t s = (frames - 1) % slots();
+    const Slot *current = slot(s);
+    const uint64_t sequence = current->sequence.load(std::memory_order_acquire);
+    if (sequence % 2 != 0) {
+      return false;
+    }
+    f(current->frame, current->count, positions(s), velocities(s), colors(s));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return current->sequence.load(std::memory_order_relaxed) == sequence;
+  }
+
+  /// copy of the newest frame, false if none could be read in attempts tries
+  bool read(SnapshotData<S> &out, size_t attempts = 16) const {
+    for (size_t a = 0; a < attempts; ++a) {
+      bool copied = view([&out](uint64_t frame, size_t count, const S *position,
+                                const S *velocity, const cl_int4 *color) {
+        out.resize(count);
+        out.step = frame;
+        std::memcpy(out.position.data(), position, count * sizeof(S));
+        std::memcpy(out.velocity.data(), velocity, count * sizeof(S));
+        std::memcpy(out.color.data(), color, count * sizeof(cl_int4));
+      });
+      if (copied) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  explicit LiveExport(SharedMemory shm)
+      : _shm(std::move(shm)), _header(static_cast<Header *>(_shm.data())) {}
+
+  static constexpr uint32_t dimension() {
+    return std::is_same_v<S, Space2D> ? 2 : 3;
+  }
+
+  static size_t aligned(size_t bytes) { return (bytes + 63) & ~size_t{63}; }
+
+  static size_t slot_bytes(size_t capacity) {
+    return aligned(capacity * sizeof(S)) * 2 +
+           aligned(capacity * sizeof(cl_int4));
+  }
+
+  static size_t bytes(size_t capacity, size_t slots) {
+    return aligned(sizeof(Header)) + slots * sizeof(Slot) +
+           slots * slot_bytes(capacity);
+  }
+
+  [[nodiscard]] Slot *slot(size_t s) const {
+    return reinterpret_cast<Slot *>(reinterpret_cast<char *>(_header) +
+                                    aligned(sizeof(Header))) +
+           s;
+  }
+
+  [[nodiscard]] char *slot_data(size_t s) const {
+    return reinterpret_cast<char *>(slot(slots())) +
+           s * slot_bytes(capacity());
+  }
+
+  [[nodiscard]] S *positions(size_t s) const {
+    return reinterpret_cast<S *>(slot_data(s));
+  }
+
+  [[nodiscard]] S *velocities(size_t s) const {
+    return reinterpret_cast<S *>(slot_data(s) +
+                                 aligned(capacity() * sizeof(S)));
+  }
+
+  [[nodiscard]] cl_int4 *colors(size_t s) const {
+    return reinterpret_cast<cl_int4 *>(slot_data(s) +
+                                       2 * aligned(capacity() * sizeof(S)));
+  }
+
+  SharedMemory _shm;
+  Header *_header{nullptr};
+  Slot *_writing{nullptr};
+};
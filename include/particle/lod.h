@@ -0,0 +1,144 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <particle/grid.h>
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+enum class LodTier : uint8_t { FULL, SPARSE, BALLISTIC };
+
+struct LodSettings {
+  /// cells whose 3x3 block holds at least this many particles run every step
+  size_t dense{8};
+  /// sparse cells run the neighbor rules every interval-th step
+  uint32_t interval{4};
+  /// cells overlapping this region always run every step
+  Space visible{{0, 0}, {0, 0}};
+};
+
+template <Dimension S> class LodScheduler {};
+
+/**
+ * Assigns every grid cell an update tier from the occupancy of its 3x3 block:
+ * FULL for dense or visible cells and cells near predators, BALLISTIC for
+ * particles without any neighbor, SPARSE otherwise. Sparse cells take turns
+ * (staggered by cell) so the work is spread evenly over the steps.
+ */
+template <> class LodScheduler<Space2D> {
+public:
+  LodScheduler() = default;
+  /// an interval of 0 is taken as 1 (every step)
+  explicit LodScheduler(LodSettings settings) : _settings(settings) {
+    _settings.interval = std::max<uint32_t>(_settings.interval, 1);
+  }
+
+  [[nodiscard]] const LodSettings &settings() const { return _settings; }
+
+  void update(Grid<Space2D> &grid, uint64_t step, BS::thread_pool &pool) {
+    _y_size = grid.y_size();
+    _scale.resize(grid.x_size() * grid.y_size());
+    _tier.assign(_scale.size(), LodTier::BALLISTIC);
+    const Space &visible = _settings.visible;
+    const float gs = static_cast<float>(grid.grid_size());
+    const Space extent = grid.extent();
+    const bool predators_present = grid.has_predators();
+    auto classify = [&](size_t beg, size_t end) {
+      for (size_t x = beg; x < end; ++x) {
+        for (size_t y = 0; y < grid.y_size(); ++y) {
+          // only cells with particles are ever looked up
+          if (grid.data()[x][y].empty()) {
+            continue;
+          }
+          size_t occupancy = 0;
+          size_t predators = 0;
+          for (size_t n_x = x > 0 ? x - 1 : 0;
+               n_x <= std::min(x + 1, grid.x_size() - 1); ++n_x) {
+            for (size_t n_y = y > 0 ? y - 1 : 0;
+                 n_y <= std::min(y + 1, grid.y_size() - 1); ++n_y) {
+              occupancy += grid.data()[n_x][n_y].size();
+              if (predators_present) {
+                predators += grid.predator_data()[n_x][n_y].size();
+              }
+            }
+          }
+          const float x0 = extent.position.x + x * gs;
+          const float y0 = extent.position.y + y * gs;
+          const bool seen = x0 < visible.position.x + visible.size.x &&
+                            x0 + gs > visible.position.x &&
+                            y0 < visible.position.y + visible.size.y &&
+                            y0 + gs > visible.position.y;
+          LodTier tier = LodTier::SPARSE;
+          if (seen || predators > 0 || occupancy >= _settings.dense) {
+            tier = LodTier::FULL;
+          } else if (occupancy <= 1) {
+            tier = LodTier::BALLISTIC;
+          }
+          const size_t cell = x * _y_size + y;
+          _tier[cell] = tier;
+          _scale[cell] = scale(tier, cell, step);
+        }
+      }
+    };
+    pool.push_loop(grid.x_size(), classify);
+    pool.wait_for_tasks();
+
+    _counts.fill(0);
+    for (size_t x = 0; x < grid.x_size(); ++x) {
+      for (size_t y = 0; y < grid.y_size(); ++y) {
+        _counts[static_cast<size_t>(_tier[x * _y_size + y])] +=
+            grid.data()[x][y].size();
+      }
+    }
+  }
+
+  /**
+   * Factor for the neighbor rule steering of a particle in cell in this
+   * step: 1 every step, interval on the steps a sparse cell is due (it
+   * catches up on the skipped steps), 0 if the rules are skipped.
+   */
+  [[nodiscard]] float scale(cl_int2 cell) const {
+    return _scale[cell.x * _y_size + cell.y];
+  }
+
+  /// particles per tier in the last update, indexed by LodTier
+  [[nodiscard]] const std::array<size_t, 3> &counts() const {
+    return _counts;
+  }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return vector_bytes(_scale) + vector_bytes(_tier);
+  }
+
+private:
+  [[nodiscard]] float scale(LodTier tier, size_t cell, uint64_t step) const {
+    switch (tier) {
+    case LodTier::FULL:
+      return 1;
+    case LodTier::SPARSE:
+      return (cell + step) % _settings.interval == 0
+                 ? static_cast<float>(_settings.interval)
+                 : 0;
+    case LodTier::BALLISTIC:
+    default:
+      return 0;
+    }
+  }
+
+  LodSettings _settings{};
+  size_t _y_size{0};
+  std::vector<float> _scale;
+  std::vector<LodTier> _tier;
+  std::array<size_t, 3> _counts{};
+};
@@ -0,0 +1,168 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <particle/grid.h>
+#include <particle/particle.h>
+#include <particle/species.h>
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+template <Dimension S> class NeighborList {};
+
+/**
+ * Verlet lists: for every live particle, the particles within the largest
+ * rule radius plus a skin, stored back to back (CSR). Only neighbors of a
+ * species the particle interacts with are listed. The lists stay valid
+ * until some particle moved more than skin / 2 since the build, because
+ * until then no pair can have closed the distance from outside the listed
+ * radius to within the rule radius.
+ */
+template <> class NeighborList<Space2D> {
+public:
+  NeighborList() = default;
+  explicit NeighborList(float skin) : _skin(skin) {}
+
+  void set_skin(float skin) {
+    _skin = skin;
+    _particles = nullptr;
+  }
+  [[nodiscard]] float skin() const { return _skin; }
+
+  /**
+   * True if the lists have to be rebuilt before they can be used for
+   * particles: the particle set or the species table changed, or a particle
+   * moved more than skin / 2.
+   */
+  bool stale(const Particles<Space2D> &particles, const SpeciesTable &species,
+             BS::thread_pool &pool) const {
+    if (&particles != _particles ||
+        particles.layout_version() != _layout ||
+        species.max_radius() != _radius || species.size() != _masks.size()) {
+      return true;
+    }
+    for (SpeciesId s = 0; s < _masks.size(); ++s) {
+      if (species.mask(s) != _masks[s]) {
+        return true;
+      }
+    }
+    const float limit = _skin * _skin / 4;
+    auto moved_too_far = [&](size_t beg, size_t end) {
+      for (size_t i = beg; i < end; ++i) {
+        float dx = particles.position_data()[i].x - _reference[i].x;
+        float dy = particles.position_data()[i].y - _reference[i].y;
+        if (dx * dx + dy * dy > limit) {
+          return true;
+        }
+      }
+      return false;
+    };
+    auto moved = pool.parallelize_loop(particles.extent(), moved_too_far).get();
+    return std::any_of(moved.begin(), moved.end(), [](bool m) { return m; });
+  }
+
+  /// grid must be up to date for particles
+  void build(const Particles<Space2D> &particles, Grid<Space2D> &grid,
+             const SpeciesTable &species, BS::thread_pool &pool) {
+    const float radius = species.max_radius() + _skin;
+    const float radius_sq = radius * radius;
+    const int reach = static_cast<int>(std::ceil(radius / grid.grid_size()));
+    const Space2D *position = particles.position_data();
+    const SpeciesId *species_of = particles.species_data();
+
+    struct Block {
+      std::vector<uint32_t> counts;
+      std::vector<uint32_t> neighbors;
+    };
+    auto build_block = [&](size_t beg, size_t end) {
+      Block block;
+      block.counts.reserve(end - beg);
+      for (size_t i = beg; i < end; ++i) {
+        const uint32_t mask = species.mask(species_of[i]);
+        const size_t before = block.neighbors.size();
+        cl_int2 cell = grid.cell_of(position[i]);
+        for (int n_x = std::max(0, cell.x - reach);
+             n_x <= std::min<int>(grid.x_size() - 1, cell.x + reach); ++n_x) {
+          for (int n_y = std::max(0, cell.y - reach);
+               n_y <= std::min<int>(grid.y_size() - 1, cell.y + reach);
+               ++n_y) {
+            for (size_t j : grid.data()[n_x][n_y]) {
+              float dx = position[j].x - position[i].x;
+              float dy = position[j].y - position[i].y;
+              if (j != i && dx * dx + dy * dy < radius_sq &&
+                  ((mask >> species_of[j]) & 1u)) {
+                block.neighbors.push_back(static_cast<uint32_t>(j));
+              }
+            }
+          }
+        }
+        block.counts.push_back(
+            static_cast<uint32_t>(block.neighbors.size() - before));
+      }
+      return block;
+    };
+    auto blocks = pool.parallelize_loop(particles.size(), build_block).get();
+
+    _offsets.assign(1, 0);
+    _offsets.reserve(particles.size() + 1);
+    _neighbors.clear();
+    for (const Block &block : blocks) {
+      for (uint32_t count : block.counts) {
+        _offsets.push_back(_offsets.back() + count);
+      }
+      _neighbors.insert(_neighbors.end(), block.neighbors.begin(),
+                        block.neighbors.end());
+    }
+
+    _reference.assign(position, position + particles.extent());
+    _particles = &particles;
+    _layout = particles.layout_version();
+    _radius = species.max_radius();
+    _masks.resize(species.size());
+    for (SpeciesId s = 0; s < _masks.size(); ++s) {
+      _masks[s] = species.mask(s);
+    }
+    ++_builds;
+  }
+
+  [[nodiscard]] const uint32_t *begin(size_t index) const {
+    return _neighbors.data() + _offsets[index];
+  }
+  [[nodiscard]] const uint32_t *end(size_t index) const {
+    return _neighbors.data() + _offsets[index + 1];
+  }
+
+  [[nodiscard]] size_t builds() const { return _builds; }
+  /// listed pairs, i.e. candidates the rules test per step
+  [[nodiscard]] size_t pairs() const { return _neighbors.size(); }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return vector_bytes(_offsets) + vector_bytes(_neighbors) +
+           vector_bytes(_reference) + vector_bytes(_masks);
+  }
+
+private:
+  float _skin{0};
+
+  std::vector<uint32_t> _offsets;
+  std::vector<uint32_t> _neighbors;
+
+  // state the lists were built from
+  std::vector<Space2D> _reference;
+  const Particles<Space2D> *_particles{nullptr};
+  uint64_t _layout{0};
+  float _radius{0};
+  std::vector<uint32_t> _masks;
+  size_t _builds{0};
+};
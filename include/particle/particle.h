@@ -1,8 +1,20 @@
 #pragma once
 
+#include <SDL.h>
+
+#include <particle/handle.h>
+#include <particle/species.h>
 #include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
 
 template <Dimension T> class Particles {
   template <Dimension> friend class BoidsSimulation;
@@ -11,12 +23,15 @@ template <Dimension T> class Particles {
 public:
   Particles() = default;
   explicit Particles(size_t size)
-      : _size(size), _position(new T[size]), _velocity(new T[size]),
-        _color(new cl_int3[size]) {}
+      : _size(size), _capacity(size), _position(new T[size]),
+        _velocity(new T[size]), _color(new cl_int3[size]) {
+    init_handles();
+  }
 
   Particles(size_t size, T *positions, T *velocities, cl_int3 *color)
-      : _size(size), _position(positions), _velocity(velocities), _color(color),
-        _color_owned(false), _velocity_owned(false), _position_owned(false) {
+      : _size(size), _capacity(size), _position(positions),
+        _velocity(velocities), _color(color), _position_owned(false),
+        _velocity_owned(false), _color_owned(false) {
     if (_position == nullptr) {
       _position = new T[size];
       _position_owned = true;
@@ -29,92 +44,83 @@ public:
       _color = new cl_int4[size];
       _color_owned = true;
     }
+    init_handles();
   }
 
-  Particles(Particles<T> &&other)  noexcept {
-    if (&other != this) {
-      _position = other._position;
-      _velocity = other._velocity;
-      _color = other._color;
-      _position_owned = other._position_owned;
-      _velocity_owned = other._velocity_owned;
-      _color_owned = other._color_owned;
-      _size = other._size;
-    }
-  }
+  Particles(Particles<T> &&other) noexcept { swap(other); }
 
-  Particles& operator=(Particles<T> &&other) noexcept {
+  Particles &operator=(Particles<T> &&other) noexcept {
     if (&other != this) {
-      if (_position_owned)
-        delete[] _position;
-      if (_velocity_owned)
-        delete[] _velocity;
-      if (_color_owned)
-        delete[] _color;
-
-      _position = other._position;
-      _velocity = other._velocity;
-      _color = other._color;
-
-      _position_owned = other._position_owned;
-      _velocity_owned = other._velocity_owned;
-      _color_owned = other._color_owned;
-
-      _size = other._size;
-
-      other._position = nullptr;
-      other._velocity = nullptr;
-      other._color = nullptr;
-      other._size = 0;
+      Particles<T> tmp(std::move(other));
+      swap(tmp);
     }
     return *this;
   }
 
-  Particles& operator=(const Particles<T>& other) {
+  Particles &operator=(const Particles<T> &other) {
     if (this != &other) {
-      if (_position_owned)
-        delete[] _position;
-      if (_velocity_owned)
-        delete[] _velocity;
-      if (_color_owned)
-        delete[] _color;
+      release_storage();
 
       _size = other._size;
+      _capacity = other._capacity;
       if (other._position_owned) {
-        _position = new T[_size];
+        _position = new T[_capacity];
         _position_owned = true;
-        std::memcpy(_position, other._position, _size);
+        std::copy_n(other._position, _size, _position);
       } else {
         _position = other._position;
         _position_owned = false;
       }
       if (other._velocity_owned) {
-        _velocity = new T[_size];
+        _velocity = new T[_capacity];
         _velocity_owned = true;
-        std::memcpy(_velocity, other._velocity, _size);
+        std::copy_n(other._velocity, _size, _velocity);
       } else {
         _velocity = other._velocity;
         _velocity_owned = false;
       }
-      if (other._color_owned) {
-        _color = new cl_int4[_size];
+      if (other._color_owned && other._color != nullptr) {
+        _color = new cl_int4[_capacity];
         _color_owned = true;
-        std::memcpy(_color, other._color, _size);
+        std::copy_n(other._color, _size, _color);
       } else {
         _color = other._color;
         _color_owned = false;
       }
+      _slot = other._slot;
+      _dead = other._dead;
+      _species = other._species;
+      _handles = other._handles;
+      _palette = other._palette;
+      _palette_colors = other._palette_colors;
+      _pending_despawns = other._pending_despawns;
+      _ghosts = 0;
+      ++_layout;
     }
     return *this;
   }
 
-  ~Particles() {
-    if (_position_owned)
-      delete[] _position;
-    if (_velocity_owned)
-      delete[] _velocity;
-    if (_color_owned)
-      delete[] _color;
+  ~Particles() { release_storage(); }
+
+  void swap(Particles<T> &other) noexcept {
+    std::swap(_size, other._size);
+    std::swap(_capacity, other._capacity);
+    std::swap(_position, other._position);
+    std::swap(_velocity, other._velocity);
+    std::swap(_color, other._color);
+    std::swap(_position_owned, other._position_owned);
+    std::swap(_velocity_owned, other._velocity_owned);
+    std::swap(_color_owned, other._color_owned);
+    std::swap(_slot, other._slot);
+    std::swap(_dead, other._dead);
+    std::swap(_species, other._species);
+    std::swap(_handles, other._handles);
+    std::swap(_palette, other._palette);
+    std::swap(_palette_colors, other._palette_colors);
+    std::swap(_pending_despawns, other._pending_despawns);
+    std::swap(_ghosts, other._ghosts);
+    ++_layout;
+    ++other._layout;
   }
 
   void set_random_positions(int x0, int x1, int y0, int y1) {
@@ -129,52 +135,347 @@ public:
     }
   }
 
-  void resize(size_t size) {
-    T *old_position = _position;
-    T *old_velocity = _velocity;
-    cl_int4 *old_color = _color;
-
-    if (_position_owned)
-      delete[] _position;
-    if (_velocity_owned)
-      delete[] _velocity;
-    if (_color_owned)
-      delete[] _color;
-
-    _position = new T[size];
-    _velocity = new T[size];
-    _color = new cl_int4[size];
+  /**
+   * Grow the storage to hold at least capacity particles. The live range is
+   * preserved, buffers that were not owned are replaced by owned copies.
+   */
+  void reserve(size_t capacity) {
+    if (capacity <= _capacity) {
+      return;
+    }
+    T *position = new T[capacity];
+    T *velocity = new T[capacity];
+    // without a palette every particle stores its color
+    cl_int4 *color = _palette_colors ? nullptr : new cl_int4[capacity];
 
-    size_t copy_size = std::min(size, _size);
+    std::copy_n(_position, _size, position);
+    std::copy_n(_velocity, _size, velocity);
+    if (_color != nullptr) {
+      std::copy_n(_color, _size, color);
+    }
 
-    std::memcpy(_position, old_position, copy_size);
-    std::memcpy(_velocity, old_velocity, copy_size);
-    std::memcpy(_color, old_color, copy_size);
+    release_storage();
 
+    _position = position;
+    _velocity = velocity;
+    _color = color;
     _position_owned = true;
     _velocity_owned = true;
     _color_owned = true;
+
+    _capacity = capacity;
+    _handles.reserve(_capacity);
+    _slot.resize(_capacity);
+    _dead.resize(_capacity, 0);
+    _species.resize(_capacity, 0);
+  }
+
+  /**
+   * Set the number of live particles. New particles are zero-initialized,
+   * truncated particles are released immediately.
+   */
+  void resize(size_t size) {
+    _ghosts = 0;
+    ++_layout;
+    if (size > _size) {
+      reserve(size);
+      spawn(size - _size, nullptr, nullptr);
+    } else {
+      for (size_t i = size; i < _size; ++i) {
+        _handles.release(_slot[i]);
+        if (_dead[i]) {
+          _dead[i] = 0;
+          --_pending_despawns;
+        }
+      }
+      _size = size;
+    }
+  }
+
+  /**
+   * Append count particles to the live range. positions and velocities may be
+   * nullptr (zero-initialized). If handles is given, it receives one handle
+   * per spawned particle, species defaults to 0 if not given. Must not be
+   * called while an update is running.
+   */
+  void spawn(size_t count, const T *positions, const T *velocities,
+             ParticleHandle *handles = nullptr,
+             const SpeciesId *species = nullptr) {
+    // spawned particles take the place of the ghosts
+    _ghosts = 0;
+    ++_layout;
+    grow(_size + count);
+    assert(_color != nullptr || _palette_colors);
+    for (size_t k = 0; k < count; ++k) {
+      const size_t index = _size + k;
+      _position[index] = positions != nullptr ? positions[k] : T{};
+      _velocity[index] = velocities != nullptr ? velocities[k] : T{};
+      if (_color != nullptr) {
+        _color[index] = {255, 255, 255, 255};
+      }
+      _dead[index] = 0;
+      _species[index] = species != nullptr ? species[k] : 0;
+      ParticleHandle handle = _handles.acquire(static_cast<uint32_t>(index));
+      _slot[index] = handle.slot;
+      if (handles != nullptr) {
+        handles[k] = handle;
+      }
+    }
+    _size += count;
+  }
+
+  ParticleHandle spawn(T position, T velocity, SpeciesId species = 0) {
+    ParticleHandle handle;
+    spawn(1, &position, &velocity, &handle, &species);
+    return handle;
+  }
+
+  /**
+   * Mark a particle for removal. The particle stays in the live range until
+   * the next compact(). Safe to call concurrently, e.g. from rule tasks.
+   */
+  bool despawn(ParticleHandle handle) {
+    uint32_t index = _handles.index(handle);
+    if (index == HandleTable::npos) {
+      return false;
+    }
+    despawn_at(index);
+    return true;
+  }
+
+  void despawn_at(size_t index) {
+    if (std::atomic_ref<uint8_t>(_dead[index])
+            .exchange(1, std::memory_order_relaxed) == 0) {
+      std::atomic_ref<size_t>(_pending_despawns)
+          .fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Remove all despawned particles by swap-remove: live particles from the
+   * tail of the range are moved into the holes left below the new size, so
+   * the live range stays contiguous. Returns the number of removed particles.
+   */
+  size_t compact(BS::thread_pool &pool) {
+    if (_pending_despawns == 0) {
+      return 0;
+    }
+    _ghosts = 0;
+    ++_layout;
+    auto collect_dead = [this](size_t beg, size_t end) {
+      std::vector<uint32_t> dead;
+      for (size_t i = beg; i < end; ++i) {
+        if (_dead[i]) {
+          dead.push_back(static_cast<uint32_t>(i));
+        }
+      }
+      return dead;
+    };
+    std::vector<uint32_t> dead;
+    dead.reserve(_pending_despawns);
+    for (const auto &block : pool.parallelize_loop(_size, collect_dead).get()) {
+      dead.insert(dead.end(), block.begin(), block.end());
+    }
+
+    const size_t new_size = _size - dead.size();
+    // dead particles below new_size are holes, live particles at or above
+    // new_size fill them. Both sets have the same size.
+    auto tail = std::lower_bound(dead.begin(), dead.end(), new_size);
+    std::vector<uint32_t> movers;
+    movers.reserve(std::distance(dead.begin(), tail));
+    for (size_t i = new_size; i < _size; ++i) {
+      if (tail != dead.end() && *tail == i) {
+        ++tail;
+      } else {
+        movers.push_back(static_cast<uint32_t>(i));
+      }
+    }
+
+    for (uint32_t index : dead) {
+      _handles.release(_slot[index]);
+    }
+
+    auto fill_holes = [this, &dead, &movers](size_t beg, size_t end) {
+      for (size_t k = beg; k < end; ++k) {
+        move_particle(movers[k], dead[k]);
+      }
+    };
+    pool.push_loop(movers.size(), fill_holes);
+    pool.wait_for_tasks();
+
+    std::fill(_dead.begin() + new_size, _dead.begin() + _size, 0);
+    const size_t removed = _size - new_size;
+    _size = new_size;
+    _pending_despawns = 0;
+    return removed;
+  }
+
+  /**
+   * Place read-only copies of particles owned elsewhere (e.g. the halo of a
+   * neighboring tile) behind the live range. Ghosts are visible to neighbor
+   * queries but are never updated, and they are dropped by the next spawn or
+   * compaction.
+   */
+  void set_ghosts(size_t count, const T *positions, const T *velocities,
+                  const SpeciesId *species = nullptr) {
+    _ghosts = 0;
+    ++_layout;
+    grow(_size + count);
+    std::copy_n(positions, count, _position + _size);
+    std::copy_n(velocities, count, _velocity + _size);
+    if (species != nullptr) {
+      std::copy_n(species, count, _species.begin() + _size);
+    } else {
+      std::fill_n(_species.begin() + _size, count, 0);
+    }
+    _ghosts = count;
+  }
+
+  void clear_ghosts() {
+    if (_ghosts > 0) {
+      _ghosts = 0;
+      ++_layout;
+    }
+  }
+
+  [[nodiscard]] ParticleHandle handle(size_t index) const {
+    return _handles.handle(_slot[index]);
+  }
+
+  [[nodiscard]] bool alive(ParticleHandle handle) const {
+    return _handles.alive(handle);
+  }
+
+  /// Current index of the particle, HandleTable::npos if it was despawned.
+  [[nodiscard]] uint32_t index(ParticleHandle handle) const {
+    return _handles.index(handle);
   }
 
   T *position_data() { return _position; }
   const T *position_data() const { return _position; }
   T *velocity_data() { return _velocity; }
   const T *velocity_data() const { return _velocity; }
+  /// nullptr while the colors come from a palette
   cl_int4 *color_data() { return _color; }
   [[nodiscard]] const cl_int4 *color_data() const { return _color; }
 
+  [[nodiscard]] cl_int4 color(size_t index) const {
+    if (_color != nullptr) {
+      return _color[index];
+    }
+    return _species[index] < _palette.size() ? _palette[_species[index]]
+                                             : cl_int4{255, 255, 255, 255};
+  }
+
+  /**
+   * Take colors from a palette indexed by species instead of storing one
+   * color (16 bytes) per particle. The color array is released; switching
+   * back with clear_palette() starts from the palette colors.
+   */
+  void set_palette(std::vector<cl_int4> palette) {
+    _palette = std::move(palette);
+    _palette_colors = true;
+    if (_color != nullptr) {
+      if (_color_owned) {
+        delete[] _color;
+      }
+      _color = nullptr;
+      _color_owned = true;
+    }
+  }
+
+  void clear_palette() {
+    if (_color == nullptr) {
+      _color = new cl_int4[_capacity];
+      _color_owned = true;
+      for (size_t i = 0; i < _capacity; ++i) {
+        _color[i] = i < extent() ? color(i) : cl_int4{255, 255, 255, 255};
+      }
+    }
+    _palette.clear();
+    _palette_colors = false;
+  }
+
+  [[nodiscard]] bool palette_colors() const { return _palette_colors; }
+
+  /// heap bytes of the particle arrays, the bookkeeping and the handles
+  [[nodiscard]] size_t memory_usage() const {
+    size_t bytes = _capacity * 2 * sizeof(T);
+    if (_color != nullptr && _color_owned) {
+      bytes += _capacity * sizeof(cl_int4);
+    }
+    return bytes + vector_bytes(_slot) + vector_bytes(_dead) +
+           vector_bytes(_species) + vector_bytes(_palette) +
+           _handles.memory_usage();
+  }
+  SpeciesId *species_data() { return _species.data(); }
+  [[nodiscard]] const SpeciesId *species_data() const {
+    return _species.data();
+  }
+
   void draw(SDL_Renderer *renderer) const {
     for (int i = 0; i < _size; ++i) {
-      SDL_SetRenderDrawColor(renderer, _color[i].x, _color[i].y, _color[i].z,
-                             _color[i].w);
+      const cl_int4 c = color(i);
+      SDL_SetRenderDrawColor(renderer, c.x, c.y, c.z, c.w);
       SDL_RenderDrawPoint(renderer, _position[i].x, _position[i].y);
     }
   }
 
   [[nodiscard]] size_t size() const { return _size; }
+  [[nodiscard]] size_t capacity() const { return _capacity; }
+  [[nodiscard]] size_t ghosts() const { return _ghosts; }
+  /// live particles followed by ghosts
+  [[nodiscard]] size_t extent() const { return _size + _ghosts; }
+
+  /**
+   * Changes whenever particles are added, removed or moved to another index,
+   * i.e. whenever index-based structures built from this set are stale.
+   */
+  [[nodiscard]] uint64_t layout_version() const { return _layout; }
 
 private:
+  void init_handles() {
+    _handles.reserve(_capacity);
+    _slot.resize(_capacity);
+    _dead.assign(_capacity, 0);
+    _species.assign(_capacity, 0);
+    for (size_t i = 0; i < _size; ++i) {
+      _slot[i] = _handles.acquire(static_cast<uint32_t>(i)).slot;
+    }
+  }
+
+  void grow(size_t required) {
+    if (required > _capacity) {
+      reserve(std::max(required, 2 * _capacity));
+    }
+  }
+
+  void move_particle(size_t from, size_t to) {
+    _position[to] = _position[from];
+    _velocity[to] = _velocity[from];
+    if (_color != nullptr) {
+      _color[to] = _color[from];
+    }
+    _slot[to] = _slot[from];
+    _species[to] = _species[from];
+    _dead[to] = 0;
+    _handles.relocate(_slot[to], static_cast<uint32_t>(to));
+  }
+
+  void release_storage() {
+    if (_position_owned)
+      delete[] _position;
+    if (_velocity_owned)
+      delete[] _velocity;
+    if (_color_owned)
+      delete[] _color;
+    _position = nullptr;
+    _velocity = nullptr;
+    _color = nullptr;
+  }
+
   size_t _size{0};
+  size_t _capacity{0};
 
   T *_position{nullptr};
   T *_velocity{nullptr};
@@ -183,4 +484,16 @@ private:
   bool _position_owned{true};
   bool _velocity_owned{true};
   bool _color_owned{true};
+
+  // handle slot of each particle, its pending-despawn flag and its species
+  std::vector<uint32_t> _slot;
+  std::vector<uint8_t> _dead;
+  std::vector<SpeciesId> _species;
+  HandleTable _handles;
+  std::vector<cl_int4> _palette;
+  /// colors come from _palette, _color stays nullptr
+  bool _palette_colors{false};
+  size_t _pending_despawns{0};
+  size_t _ghosts{0};
+  uint64_t _layout{0};
 };
@@ -0,0 +1,299 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+template <Dimension S> class QuadTree {};
+
+/**
+ * Barnes-Hut quadtree over particle positions, used for the far-field
+ * attraction toward distant flock mass. Particles are sorted by their Morton
+ * code, so every node covers a contiguous range of the sorted particles. The
+ * codes, the sort and the subtrees below the top levels are built in
+ * parallel. Every particle has mass 1.
+ */
+template <> class QuadTree<Space2D> {
+public:
+  struct Node {
+    Space2D center; // center of mass
+    float mass;
+    float size;           // side length of the node's square
+    uint32_t first_child; // four consecutive children, 0 for leaves
+    uint32_t begin;       // particle range in sorted order
+    uint32_t end;
+  };
+
+  explicit QuadTree(size_t leaf_size = 8) : _leaf_size(leaf_size) {}
+
+  /// bounds is covered by the root square, positions outside are clamped
+  void build(const Space2D *positions, size_t count, const Space &bounds,
+             BS::thread_pool &pool) {
+    _origin = {static_cast<float>(bounds.position.x),
+               static_cast<float>(bounds.position.y)};
+    _side = static_cast<float>(std::max(bounds.size.x, bounds.size.y));
+    _keys.resize(count);
+    _sorted.resize(count);
+    _index.resize(count);
+    _nodes.clear();
+    if (count == 0) {
+      return;
+    }
+
+    const float scale = 65536.f / _side;
+    auto encode = [&](size_t beg, size_t end) {
+      for (size_t i = beg; i < end; ++i) {
+        auto quantize = [scale](float offset) {
+          return static_cast<uint32_t>(
+              std::clamp(offset * scale, 0.f, 65535.f));
+        };
+        uint64_t code = interleave(quantize(positions[i].x - _origin.x)) |
+                        interleave(quantize(positions[i].y - _origin.y)) << 1;
+        _keys[i] = code << 32 | i;
+      }
+    };
+    pool.push_loop(count, encode);
+    pool.wait_for_tasks();
+    sort(pool);
+
+    auto gather = [&](size_t beg, size_t end) {
+      for (size_t k = beg; k < end; ++k) {
+        _index[k] = static_cast<uint32_t>(_keys[k]);
+        _sorted[k] = positions[_index[k]];
+      }
+    };
+    pool.push_loop(count, gather);
+    pool.wait_for_tasks();
+
+    // the top levels are split serially, deeper subtrees are independent
+    // tasks that are appended afterwards
+    std::vector<Deferred> deferred;
+    _nodes.push_back({{0, 0}, 0, _side, 0, 0, static_cast<uint32_t>(count)});
+    split(_nodes, 0, 0, &deferred);
+    const size_t top_nodes = _nodes.size();
+
+    std::vector<std::vector<Node>> subtrees(deferred.size());
+    auto build_subtrees = [&](size_t beg, size_t end) {
+      for (size_t t = beg; t < end; ++t) {
+        subtrees[t].push_back(_nodes[deferred[t].node]);
+        split(subtrees[t], 0, deferred[t].level, nullptr);
+      }
+    };
+    pool.push_loop(deferred.size(), build_subtrees);
+    pool.wait_for_tasks();
+
+    for (size_t t = 0; t < deferred.size(); ++t) {
+      // local index k > 0 becomes offset + k - 1, the local root replaces
+      // the deferred node
+      const auto offset = static_cast<uint32_t>(_nodes.size() - 1);
+      for (Node &node : subtrees[t]) {
+        if (node.first_child != 0) {
+          node.first_child += offset;
+        }
+      }
+      _nodes[deferred[t].node] = subtrees[t][0];
+      _nodes.insert(_nodes.end(), subtrees[t].begin() + 1, subtrees[t].end());
+    }
+    // children of top nodes have larger indices
+    for (size_t n = top_nodes; n-- > 0;) {
+      if (_nodes[n].first_child != 0) {
+        aggregate(_nodes, n);
+      }
+    }
+  }
+
+  /**
+   * Sum of d / (|d|^2 + softening^2)^(3/2) over all particles except self,
+   * where d points from position to the particle. Nodes smaller than theta
+   * times their distance are taken as a whole.
+   */
+  [[nodiscard]] Space2D attraction(const Space2D &position, size_t self,
+                                   float theta, float softening) const {
+    Space2D sum{0, 0};
+    if (_nodes.empty()) {
+      return sum;
+    }
+    const float eps_sq = softening * softening;
+    const float theta_sq = theta * theta;
+    auto add = [&](const Space2D &to, float mass) {
+      float dx = to.x - position.x;
+      float dy = to.y - position.y;
+      float r_sq = dx * dx + dy * dy + eps_sq;
+      float f = mass / (r_sq * std::sqrt(r_sq));
+      sum.x += dx * f;
+      sum.y += dy * f;
+    };
+
+    std::array<uint32_t, 4 * max_depth> stack{};
+    size_t top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node &node = _nodes[stack[--top]];
+      float dx = node.center.x - position.x;
+      float dy = node.center.y - position.y;
+      if (node.first_child == 0) {
+        for (uint32_t k = node.begin; k < node.end; ++k) {
+          if (_index[k] != self) {
+            add(_sorted[k], 1);
+          }
+        }
+      } else if (node.size * node.size < theta_sq * (dx * dx + dy * dy)) {
+        add(node.center, node.mass);
+      } else {
+        for (uint32_t c = 0; c < 4; ++c) {
+          if (_nodes[node.first_child + c].mass > 0) {
+            stack[top++] = node.first_child + c;
+          }
+        }
+      }
+    }
+    return sum;
+  }
+
+  [[nodiscard]] size_t size() const { return _nodes.size(); }
+  [[nodiscard]] const Node *data() const { return _nodes.data(); }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return vector_bytes(_keys) + vector_bytes(_sorted) + vector_bytes(_index) +
+           vector_bytes(_nodes);
+  }
+
+private:
+  // 16 bits per axis
+  static constexpr int max_depth = 16;
+  static constexpr int parallel_depth = 3;
+
+  struct Deferred {
+    size_t node;
+    int level;
+  };
+
+  static uint64_t interleave(uint32_t v) {
+    uint64_t x = v;
+    x = (x | x << 8) & 0x00FF00FFu;
+    x = (x | x << 4) & 0x0F0F0F0Fu;
+    x = (x | x << 2) & 0x33333333u;
+    x = (x | x << 1) & 0x55555555u;
+    return x;
+  }
+
+  /**
+   * Split node (at level) into four children until the leaf size or the
+   * maximum depth is reached. If deferred is given, nodes reaching
+   * parallel_depth are not split but recorded.
+   */
+  void split(std::vector<Node> &nodes, size_t node, int level,
+             std::vector<Deferred> *deferred) const {
+    const uint32_t begin = nodes[node].begin;
+    const uint32_t end = nodes[node].end;
+    if (end - begin <= _leaf_size || level == max_depth) {
+      leaf(nodes[node]);
+      return;
+    }
+    if (deferred != nullptr && level == parallel_depth) {
+      deferred->push_back({node, level});
+      return;
+    }
+    const int shift = 32 + 2 * (max_depth - 1 - level);
+    const auto first_child = static_cast<uint32_t>(nodes.size());
+    nodes[node].first_child = first_child;
+    const float size = nodes[node].size / 2;
+    uint32_t child_begin = begin;
+    for (uint64_t quadrant = 0; quadrant < 4; ++quadrant) {
+      auto child_end = static_cast<uint32_t>(
+          std::partition_point(_keys.begin() + child_begin,
+                               _keys.begin() + end,
+                               [&](uint64_t key) {
+                                 return ((key >> shift) & 3u) <= quadrant;
+                               }) -
+          _keys.begin());
+      nodes.push_back({{0, 0}, 0, size, 0, child_begin, child_end});
+      child_begin = child_end;
+    }
+    for (uint32_t c = 0; c < 4; ++c) {
+      split(nodes, first_child + c, level + 1, deferred);
+    }
+    if (deferred == nullptr) {
+      aggregate(nodes, node);
+    }
+  }
+
+  void leaf(Node &node) const {
+    Space2D sum{0, 0};
+    for (uint32_t k = node.begin; k < node.end; ++k) {
+      sum.x += _sorted[k].x;
+      sum.y += _sorted[k].y;
+    }
+    node.first_child = 0;
+    node.mass = static_cast<float>(node.end - node.begin);
+    node.center = node.mass > 0 ? Space2D{sum.x / node.mass, sum.y / node.mass}
+                                : Space2D{0, 0};
+  }
+
+  static void aggregate(std::vector<Node> &nodes, size_t node) {
+    Space2D sum{0, 0};
+    float mass = 0;
+    for (uint32_t c = 0; c < 4; ++c) {
+      const Node &child = nodes[nodes[node].first_child + c];
+      sum.x += child.center.x * child.mass;
+      sum.y += child.center.y * child.mass;
+      mass += child.mass;
+    }
+    nodes[node].mass = mass;
+    nodes[node].center =
+        mass > 0 ? Space2D{sum.x / mass, sum.y / mass} : Space2D{0, 0};
+  }
+
+  /// sort blocks in parallel, then merge neighboring blocks pairwise
+  void sort(BS::thread_pool &pool) {
+    const size_t blocks = std::max<size_t>(1, pool.get_thread_count());
+    std::vector<size_t> bounds(blocks + 1);
+    for (size_t b = 0; b <= blocks; ++b) {
+      bounds[b] = _keys.size() * b / blocks;
+    }
+    auto sort_blocks = [&](size_t beg, size_t end) {
+      for (size_t b = beg; b < end; ++b) {
+        std::sort(_keys.begin() + bounds[b], _keys.begin() + bounds[b + 1]);
+      }
+    };
+    pool.push_loop(blocks, sort_blocks, blocks);
+    pool.wait_for_tasks();
+    for (size_t width = 1; width < blocks; width *= 2) {
+      auto merge = [&](size_t beg, size_t end) {
+        for (size_t b = beg; b < end; ++b) {
+          size_t lo = 2 * width * b;
+          size_t mid = std::min(lo + width, blocks);
+          size_t hi = std::min(lo + 2 * width, blocks);
+          std::inplace_merge(_keys.begin() + bounds[lo],
+                             _keys.begin() + bounds[mid],
+                             _keys.begin() + bounds[hi]);
+        }
+      };
+      size_t pairs = (blocks + 2 * width - 1) / (2 * width);
+      pool.push_loop(pairs, merge, pairs);
+      pool.wait_for_tasks();
+    }
+  }
+
+  size_t _leaf_size;
+  Space2D _origin{0, 0};
+  float _side{1};
+
+  std::vector<uint64_t> _keys; // Morton code << 32 | particle index
+  std::vector<Space2D> _sorted;
+  std::vector<uint32_t> _index;
+  std::vector<Node> _nodes;
+};
@@ -0,0 +1,130 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <utility>
+#include <vector>
+
+#include <particle/types.h>
+
+/**
+ * Philox4x32-10 counter-based generator: the output is a pure function of
+ * (key, counter), so particle i can draw its numbers from counter i on any
+ * thread and the result does not depend on how the particles were split.
+ */
+class Philox4x32 {
+public:
+  using Block = std::array<uint32_t, 4>;
+
+  explicit Philox4x32(uint64_t seed)
+      : _key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)} {
+  }
+
+  /// four independent 32-bit numbers for (index, stream)
+  [[nodiscard]] Block operator()(uint64_t index, uint32_t stream = 0) const {
+    Block c{static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32),
+            stream, 0};
+    uint32_t k0 = _key[0];
+    uint32_t k1 = _key[1];
+    for (int round = 0; round < 10; ++round) {
+      const uint64_t p0 = uint64_t{0xD2511F53} * c[0];
+      const uint64_t p1 = uint64_t{0xCD9E8D57} * c[2];
+      c = {static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k0,
+           static_cast<uint32_t>(p1),
+           static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k1,
+           static_cast<uint32_t>(p0)};
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+    return c;
+  }
+
+  /// uniform in [0, 1) from the upper 24 bits
+  static float uniform(uint32_t bits) {
+    return static_cast<float>(bits >> 8) * (1.f / 16777216.f);
+  }
+
+private:
+  std::array<uint32_t, 2> _key;
+};
+
+/**
+ * Where random positions or velocities are drawn from: uniform in a box,
+ * normally distributed around one of several centers (picked uniformly), or
+ * uniform on a disc.
+ */
+class Distribution2D {
+public:
+  enum class Kind { UNIFORM, CLUSTERS, DISC };
+
+  static Distribution2D uniform(Space2D min, Space2D max) {
+    Distribution2D d(Kind::UNIFORM);
+    d._a = min;
+    d._b = max;
+    return d;
+  }
+
+  static Distribution2D clusters(std::vector<Space2D> centers, float sigma) {
+    Distribution2D d(Kind::CLUSTERS);
+    d._centers = std::move(centers);
+    d._sigma = sigma;
+    return d;
+  }
+
+  static Distribution2D disc(Space2D center, float radius) {
+    Distribution2D d(Kind::DISC);
+    d._a = center;
+    d._sigma = radius;
+    return d;
+  }
+
+  static Distribution2D zero() { return uniform({0, 0}, {0, 0}); }
+
+  [[nodiscard]] Kind kind() const { return _kind; }
+
+  /// one sample from four random words
+  [[nodiscard]] Space2D sample(const Philox4x32::Block &r) const {
+    const float u0 = Philox4x32::uniform(r[0]);
+    const float u1 = Philox4x32::uniform(r[1]);
+    switch (_kind) {
+    case Kind::CLUSTERS: {
+      if (_centers.empty()) {
+        return {0, 0};
+      }
+      const Space2D &center = _centers[static_cast<uint64_t>(r[2]) *
+                                       _centers.size() >> 32];
+      // Box-Muller, 1 - u0 is in (0, 1]
+      const float radius = _sigma * std::sqrt(-2.f * std::log(1.f - u0));
+      const float angle = 2 * std::numbers::pi_v<float> * u1;
+      return {center.x + radius * std::cos(angle),
+              center.y + radius * std::sin(angle)};
+    }
+    case Kind::DISC: {
+      const float radius = _sigma * std::sqrt(u0);
+      const float angle = 2 * std::numbers::pi_v<float> * u1;
+      return {_a.x + radius * std::cos(angle), _a.y + radius * std::sin(angle)};
+    }
+    case Kind::UNIFORM:
+    default:
+      return {_a.x + (_b.x - _a.x) * u0, _a.y + (_b.y - _a.y) * u1};
+    }
+  }
+
+private:
+  explicit Distribution2D(Kind kind) : _kind(kind) {}
+
+  Kind _kind;
+  Space2D _a{0, 0};
+  Space2D _b{0, 0};
+  float _sigma{0};
+  std::vector<Space2D> _centers;
+};
@@ -0,0 +1,269 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <particle/species.h>
+#include <particle/types.h>
+
+inline cl_float2 normalized(cl_float2 v) {
+  float length = std::sqrt(v.x * v.x + v.y * v.y);
+  return length > 0 ? cl_float2{v.x / length, v.y / length} : v;
+}
+
+/**
+ * Rule policies for the fused boids kernel. A rule keeps a small State that
+ * is fed every neighbor within its radius during the single neighbor scan,
+ * and turns it into a unit steering direction at the end. The kernel is
+ * instantiated for a fixed list of rules, so all of this is inlined into one
+ * loop.
+ */
+struct SeparationRule {
+  struct State {
+    cl_float2 steer{0, 0};
+    float count{0};
+    float radius{0};
+  };
+
+  static State init(const SpeciesParameters &sp) {
+    return {{0, 0}, 0, sp.separation_radius};
+  }
+
+  static void accumulate(State &s, const Space2D &self, const Space2D &position,
+                         const Space2D &, float distance, float weight) {
+    if (distance < s.radius) {
+      // vector pointing away from the other boid
+      s.steer.x += (self.x - position.x) / distance * weight;
+      s.steer.y += (self.y - position.y) / distance * weight;
+      s.count += weight;
+    }
+  }
+
+  static cl_float2 finish(const State &s, const Space2D &) {
+    return s.count > 0 ? normalized(s.steer) : cl_float2{0, 0};
+  }
+
+  static float weight(const SpeciesParameters &sp) {
+    return sp.separation_weight;
+  }
+};
+
+struct AlignmentRule {
+  struct State {
+    cl_float2 average{0, 0};
+    float count{0};
+    float radius{0};
+  };
+
+  static State init(const SpeciesParameters &sp) {
+    return {{0, 0}, 0, sp.alignment_radius};
+  }
+
+  static void accumulate(State &s, const Space2D &, const Space2D &,
+                         const Space2D &velocity, float distance,
+                         float weight) {
+    if (distance < s.radius) {
+      s.average.x += velocity.x * weight;
+      s.average.y += velocity.y * weight;
+      s.count += weight;
+    }
+  }
+
+  static cl_float2 finish(const State &s, const Space2D &) {
+    return s.count > 0 ? normalized(s.average) : cl_float2{0, 0};
+  }
+
+  static float weight(const SpeciesParameters &sp) {
+    return sp.alignment_weight;
+  }
+};
+
+struct CohesionRule {
+  struct State {
+    cl_float2 center{0, 0};
+    float count{0};
+    float radius{0};
+  };
+
+  static State init(const SpeciesParameters &sp) {
+    return {{0, 0}, 0, sp.cohesion_radius};
+  }
+
+  static void accumulate(State &s, const Space2D &, const Space2D &position,
+                         const Space2D &, float distance, float weight) {
+    if (distance < s.radius) {
+      s.center.x += position.x * weight;
+      s.center.y += position.y * weight;
+      s.count += weight;
+    }
+  }
+
+  static cl_float2 finish(const State &s, const Space2D &self) {
+    if (s.count == 0) {
+      return {0, 0};
+    }
+    return normalized(
+        {s.center.x / s.count - self.x, s.center.y / s.count - self.y});
+  }
+
+  static float weight(const SpeciesParameters &sp) {
+    return sp.cohesion_weight;
+  }
+};
+
+/// rule weights taken from the species table
+struct SpeciesWeights {
+  template <typename Rule> static float weight(const SpeciesParameters &sp) {
+    return Rule::weight(sp);
+  }
+};
+
+/// all rules weighted 1, lets the compiler drop the multiplications
+struct UnitWeights {
+  template <typename Rule> static float weight(const SpeciesParameters &) {
+    return 1.f;
+  }
+};
+
+/// neighbors are read from the particle arrays
+struct FullPrecision {
+  static constexpr bool packed = false;
+  static constexpr bool listed = false;
+};
+
+/**
+ * neighbors are read from the 16-bit fixed-point copies in the grid cells;
+ * the copies are kept in addition to the float arrays, so they cost memory
+ * rather than save it, but a scan reads them contiguously per cell
+ */
+struct PackedPrecision {
+  static constexpr bool packed = true;
+  static constexpr bool listed = false;
+};
+
+/// neighbors are taken from the Verlet lists, read from the particle arrays
+struct ListedNeighbors {
+  static constexpr bool packed = false;
+  static constexpr bool listed = true;
+};
+
+/**
+ * A boid that crossed the border after integration is mirrored back inside
+ * and its velocity reflected, so it cannot remain outside after a large step.
+ */
+struct ReflectiveBorder {
+  static void apply(Space2D &position, Space2D &velocity, const Space &space) {
+    reflect(position.x, velocity.x, static_cast<float>(space.position.x),
+            static_cast<float>(space.position.x + space.size.x));
+    reflect(position.y, velocity.y, static_cast<float>(space.position.y),
+            static_cast<float>(space.position.y + space.size.y));
+  }
+
+  static void reflect(float &position, float &velocity, float low,
+                      float high) {
+    if (position < low) {
+      position = std::min(2 * low - position, high);
+      velocity = std::abs(velocity);
+    } else if (position > high) {
+      position = std::max(2 * high - position, low);
+      velocity = -std::abs(velocity);
+    }
+  }
+};
+
+/// a boid leaving the space re-enters on the opposite side
+struct ToroidalBorder {
+  static void apply(Space2D &position, Space2D &, const Space &space) {
+    if (position.x < space.position.x) {
+      position.x += space.size.x;
+    } else if (position.x >= space.position.x + space.size.x) {
+      position.x -= space.size.x;
+    }
+    if (position.y < space.position.y) {
+      position.y += space.size.y;
+    } else if (position.y >= space.position.y + space.size.y) {
+      position.y -= space.size.y;
+    }
+  }
+};
+
+inline void clamp_speed(Space2D &velocity, float max_speed) {
+  float speed = std::sqrt(velocity.x * velocity.x + velocity.y * velocity.y);
+  if (speed > max_speed) {
+    velocity.x = (velocity.x / speed) * max_speed;
+    velocity.y = (velocity.y / speed) * max_speed;
+  }
+}
+
+/**
+ * Integrator policies for the fused move kernel. With deferred, the rule pass
+ * stores the steering as an acceleration instead of adding it to the
+ * velocity, and integrate() applies it scaled by dt. previous is the
+ * acceleration of the last step, which took previous_dt, or the current one
+ * if it is not known. ImpulseEuler is the original scheme: the rule pass adds
+ * the steering once per step.
+ */
+struct ImpulseEuler {
+  static constexpr bool deferred = false;
+
+  static void integrate(Space2D &position, Space2D &velocity, const Space2D &,
+                        const Space2D &, float, float dt, float) {
+    position.x += velocity.x * dt;
+    position.y += velocity.y * dt;
+  }
+};
+
+/// velocity first, then position with the new velocity
+struct SemiImplicitEuler {
+  static constexpr bool deferred = true;
+
+  static void integrate(Space2D &position, Space2D &velocity,
+                        const Space2D &acceleration, const Space2D &,
+                        float max_speed, float dt, float) {
+    velocity.x += acceleration.x * dt;
+    velocity.y += acceleration.y * dt;
+    clamp_speed(velocity, max_speed);
+    position.x += velocity.x * dt;
+    position.y += velocity.y * dt;
+  }
+};
+
+/**
+ * The stored velocity is predicted a full step ahead, v + a * dt, so the
+ * alignment rule of the next step sees the velocity the boid will have. Once
+ * that step's acceleration is known, the prediction is corrected to the
+ * Verlet velocity v + (a_previous + a) / 2 * previous_dt before the position
+ * is advanced by v * dt + a / 2 * dt^2. Both the drift v + a / 2 * dt and the
+ * prediction are clamped to max_speed, so no boid moves or is stored faster
+ * than that (safe_timestep() relies on it).
+ */
+struct VelocityVerlet {
+  static constexpr bool deferred = true;
+
+  static void integrate(Space2D &position, Space2D &velocity,
+                        const Space2D &acceleration, const Space2D &previous,
+                        float max_speed, float dt, float previous_dt) {
+    velocity.x += (acceleration.x - previous.x) * previous_dt / 2;
+    velocity.y += (acceleration.y - previous.y) * previous_dt / 2;
+    clamp_speed(velocity, max_speed);
+    Space2D drift{velocity.x + acceleration.x * dt / 2,
+                  velocity.y + acceleration.y * dt / 2};
+    clamp_speed(drift, max_speed);
+    position.x += drift.x * dt;
+    position.y += drift.y * dt;
+    velocity.x += acceleration.x * dt;
+    velocity.y += acceleration.y * dt;
+    clamp_speed(velocity, max_speed);
+  }
+};
+
+template <typename... Rules> struct RuleSet {};
+
+using DefaultRules = RuleSet<SeparationRule, AlignmentRule, CohesionRule>;
@@ -0,0 +1,598 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <particle/boids.h>
+#include <particle/random.h>
+#include <particle/species.h>
+#include <particle/types.h>
+
+/// one distribution as written in a scenario, see Scenario
+struct DistributionConfig {
+  std::string kind{"uniform"};
+  Space2D min{0, 0};
+  Space2D max{0, 0};
+  std::vector<Space2D> centers;
+  float sigma{0};
+  Space2D center{0, 0};
+  float radius{0};
+
+  [[nodiscard]] Distribution2D build() const {
+    if (kind == "uniform") {
+      return Distribution2D::uniform(min, max);
+    }
+    if (kind == "clusters") {
+      return Distribution2D::clusters(centers, sigma);
+    }
+    if (kind == "disc") {
+      return Distribution2D::disc(center, radius);
+    }
+    throw std::invalid_argument("unknown distribution '" + kind + "'");
+  }
+};
+
+/// species parameters plus the share of the particles that belong to it
+struct SpeciesConfig {
+  SpeciesParameters parameters{};
+  float share{1};
+};
+
+/**
+ * Everything needed to set up and run a boids simulation without recompiling.
+ * Scenarios are written in a small subset of TOML: [section] headers,
+ * [[species]] array tables, key = value with numbers, booleans, "strings"
+ * and (nested) arrays of numbers, and # comments. Unknown keys are errors, so
+ * typos do not silently fall back to defaults.
+ *
+ *   [simulation]  dimension, boids, width, height, grid_size, threads, pin,
+ *                 engine ("cpu"), border ("reflective", "toroidal"),
+ *                 integrator ("euler", "semi-implicit", "velocity-verlet"),
+ *                 steering_rate, adaptive, courant, max_substeps
+ *   [run]         steps, dt, seed, watch (reload the species while running,
+ *                 see ScenarioWatcher)
+ *   [position]    kind ("uniform", "clusters", "disc"), min, max, centers,
+ *   [velocity]    sigma, center, radius; positions default to the whole
+ *                 space, velocities to zero
+ *   [features]    incremental_grid, packed_neighbors, neighbor_list_skin,
+ *                 far_field_weight, far_field_theta, lod, analytics,
+ *                 analytics_bins, species_bucketing, palette_colors,
+ *                 tiled_rules, load_balancing
+ *   [output]      summary_every, stats, stats_every, positions,
+ *                 positions_every; an empty path disables the file;
+ *                 live_export (shared memory name, see LiveExport),
+ *                 live_export_slots
+ *   [[species]]   the SpeciesParameters fields, color = [r, g, b, a] and
+ *                 share, the relative number of particles of the species
+ *
+ * Every value can be overridden with "section.key=value", e.g. from the
+ * command line.
+ */
+struct Scenario {
+  size_t dimension{2};
+  size_t num_boids{1000};
+  size_t width{1000};
+  size_t height{1000};
+  size_t grid_size{30};
+  size_t num_threads{0};
+  bool pin_threads{false};
+  ENGINE engine{ENGINE::CPU};
+  BORDER border{BORDER::REFLECTIVE};
+  INTEGRATOR integrator{INTEGRATOR::EULER};
+  float steering_rate{60};
+  bool adaptive{false};
+  float courant{0.5f};
+  size_t max_substeps{8};
+
+  size_t steps{1000};
+  Duration dt{1.0 / 60.0};
+  uint64_t seed{0};
+  bool watch{false};
+
+  /// positions: kind "uniform" with an empty box means the whole space
+  DistributionConfig position{};
+  DistributionConfig velocity{};
+
+  bool incremental_grid{false};
+  bool packed_neighbors{false};
+  float neighbor_list_skin{0};
+  float far_field_weight{0};
+  float far_field_theta{0.5f};
+  bool lod{false};
+  bool analytics{false};
+  size_t analytics_bins{16};
+  bool species_bucketing{false};
+  bool palette_colors{true};
+  bool tiled_rules{false};
+  bool load_balancing{false};
+
+  size_t summary_every{0};
+  std::string stats_path;
+  size_t stats_every{1};
+  std::string positions_path;
+  size_t positions_every{0};
+  std::string live_export;
+  size_t live_export_slots{3};
+
+  /// empty means the single default species
+  std::vector<SpeciesConfig> species;
+
+  static Scenario load(const std::string &path) {
+    Scenario scenario;
+    scenario.parse_file(path);
+    return scenario;
+  }
+
+  /// command line arguments in order: scenario files and section.key=value
+  void read_arguments(const std::vector<std::string> &arguments) {
+    for (const std::string &arg : arguments) {
+      if (arg.find('=') != std::string::npos) {
+        try {
+          set(arg);
+        } catch (const std::exception &e) {
+          throw std::runtime_error(arg + ": " + e.what());
+        }
+      } else {
+        parse_file(arg);
+      }
+    }
+  }
+
+  void parse_file(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+      throw std::runtime_error("cannot open scenario '" + path + "'");
+    }
+    parse(file, path);
+  }
+
+  /// read a scenario on top of the current values
+  void parse(std::istream &in, const std::string &name = "scenario") {
+    std::string section;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number) {
+      try {
+        parse_line(line, section);
+      } catch (const std::exception &e) {
+        throw std::runtime_error(name + ":" + std::to_string(number) + ": " +
+                                 e.what());
+      }
+    }
+  }
+
+  /// "section.key=value"; [[species]] entries are addressed as species.N.key
+  void set(const std::string &assignment) {
+    const size_t eq = assignment.find('=');
+    const size_t dot = assignment.rfind('.', eq);
+    if (eq == std::string::npos || dot == std::string::npos) {
+      throw std::invalid_argument("expected section.key=value, got '" +
+                                  assignment + "'");
+    }
+    set(assignment.substr(0, dot), trim(assignment.substr(dot + 1, eq - dot - 1)),
+        trim(assignment.substr(eq + 1)));
+  }
+
+  /// a simulation set up as described, with initial positions drawn
+  [[nodiscard]] std::unique_ptr<BoidsSimulation<Space2D>> build() const {
+    if (dimension != 2) {
+      throw std::invalid_argument("only 2D boids simulations are available");
+    }
+    if (engine != ENGINE::CPU) {
+      throw std::invalid_argument("only the cpu engine is available");
+    }
+    if (border == BORDER::RESET) {
+      throw std::invalid_argument(
+          "the reset border is not available for boids");
+    }
+    auto simulation = std::make_unique<BoidsSimulation<Space2D>>(
+        num_boids, Grid<Space2D>(width, height, grid_size),
+        num_threads > 0 ? static_cast<uint>(num_threads)
+                        : std::thread::hardware_concurrency(),
+        pin_threads);
+    simulation->set_border(border);
+    simulation->set_integrator(integrator, steering_rate);
+    simulation->set_adaptive_timestep(adaptive, courant, max_substeps);
+    simulation->grid().set_incremental(incremental_grid);
+    simulation->set_packed_neighbors(packed_neighbors);
+    simulation->set_neighbor_list_skin(neighbor_list_skin);
+    simulation->set_far_field(far_field_weight, far_field_theta);
+    simulation->set_lod(lod);
+    // the stats file is written from the analytics
+    simulation->set_analytics(analytics || !stats_path.empty(), analytics_bins);
+    simulation->set_species_bucketing(species_bucketing);
+    simulation->set_tiled_rules(tiled_rules);
+    simulation->set_load_balancing(load_balancing);
+
+    if (!species.empty()) {
+      simulation->species() = species_table();
+      assign_species(simulation->particles());
+    }
+    simulation->set_palette_colors(palette_colors);
+
+    DistributionConfig initial = position;
+    if (initial.kind == "uniform" && initial.min.x == initial.max.x &&
+        initial.min.y == initial.max.y) {
+      initial.max = {static_cast<float>(width), static_cast<float>(height)};
+    }
+    simulation->randomize(initial.build(), velocity.build(), seed);
+    if (!live_export.empty()) {
+#ifdef PARTICLE_LIVE_EXPORT
+      simulation->set_live_export(live_export, 0, live_export_slots);
+#else
+      throw std::invalid_argument("live export needs POSIX shared memory");
+#endif
+    }
+    return simulation;
+  }
+
+  [[nodiscard]] SpeciesTable species_table() const {
+    SpeciesTable table;
+    if (!species.empty()) {
+      table[0] = species[0].parameters;
+    }
+    for (size_t s = 1; s < species.size(); ++s) {
+      table.add(species[s].parameters);
+    }
+    return table;
+  }
+
+private:
+  /// contiguous index ranges in proportion to the shares
+  void assign_species(Particles<Space2D> &particles) const {
+    float total = 0;
+    for (const auto &s : species) {
+      total += s.share;
+    }
+    if (total <= 0) {
+      throw std::invalid_argument("species shares must add up to more than 0");
+    }
+    SpeciesId *ids = particles.species_data();
+    size_t beg = 0;
+    float cumulative = 0;
+    for (size_t s = 0; s < species.size(); ++s) {
+      cumulative += species[s].share;
+      size_t end = s + 1 == species.size()
+                       ? particles.size()
+                       : static_cast<size_t>(cumulative / total *
+                                             static_cast<float>(particles.size()));
+      std::fill(ids + beg, ids + std::max(beg, end), static_cast<SpeciesId>(s));
+      beg = std::max(beg, end);
+    }
+  }
+
+  void parse_line(std::string line, std::string &section) {
+    line = trim(strip_comment(line));
+    if (line.empty()) {
+      return;
+    }
+    if (line.rfind("[[", 0) == 0) {
+      if (line.size() < 4 || line.substr(line.size() - 2) != "]]") {
+        throw std::invalid_argument("unterminated array table");
+      }
+      std::string table = trim(line.substr(2, line.size() - 4));
+      if (table != "species") {
+        throw std::invalid_argument("unknown array table [[" + table + "]]");
+      }
+      species.emplace_back();
+      section = "species." + std::to_string(species.size() - 1);
+      return;
+    }
+    if (line.front() == '[') {
+      if (line.back() != ']') {
+        throw std::invalid_argument("unterminated section header");
+      }
+      section = trim(line.substr(1, line.size() - 2));
+      return;
+    }
+    const size_t eq = line.find('=');
+    if (eq == std::string::npos) {
+      throw std::invalid_argument("expected key = value");
+    }
+    set(section, trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+  }
+
+  void set(const std::string &section, const std::string &key,
+           const std::string &value) {
+    if (section == "simulation") {
+      if (key == "dimension") return read(value, dimension);
+      if (key == "boids") return read(value, num_boids);
+      if (key == "width") return read(value, width);
+      if (key == "height") return read(value, height);
+      if (key == "grid_size") return read(value, grid_size);
+      if (key == "threads") return read(value, num_threads);
+      if (key == "pin") return read(value, pin_threads);
+      if (key == "engine") {
+        engine = choose<ENGINE>(value, {{"cpu", ENGINE::CPU},
+                                        {"opencl", ENGINE::OPENCL}});
+        return;
+      }
+      if (key == "border") {
+        border = choose<BORDER>(value, {{"reflective", BORDER::REFLECTIVE},
+                                        {"toroidal", BORDER::TOROIDAL},
+                                        {"reset", BORDER::RESET}});
+        return;
+      }
+      if (key == "integrator") {
+        integrator = choose<INTEGRATOR>(
+            value, {{"euler", INTEGRATOR::EULER},
+                    {"semi-implicit", INTEGRATOR::SEMI_IMPLICIT_EULER},
+                    {"velocity-verlet", INTEGRATOR::VELOCITY_VERLET}});
+        return;
+      }
+      if (key == "steering_rate") return read(value, steering_rate);
+      if (key == "adaptive") return read(value, adaptive);
+      if (key == "courant") return read(value, courant);
+      if (key == "max_substeps") return read(value, max_substeps);
+    } else if (section == "run") {
+      if (key == "steps") return read(value, steps);
+      if (key == "dt") {
+        double seconds;
+        read(value, seconds);
+        dt = Duration(seconds);
+        return;
+      }
+      if (key == "seed") return read(value, seed);
+      if (key == "watch") return read(value, watch);
+    } else if (section == "position" || section == "velocity") {
+      DistributionConfig &d = section == "position" ? position : velocity;
+      if (key == "kind") return read(value, d.kind);
+      if (key == "min") return read(value, d.min);
+      if (key == "max") return read(value, d.max);
+      if (key == "centers") return read(value, d.centers);
+      if (key == "sigma") return read(value, d.sigma);
+      if (key == "center") return read(value, d.center);
+      if (key == "radius") return read(value, d.radius);
+    } else if (section == "features") {
+      if (key == "incremental_grid") return read(value, incremental_grid);
+      if (key == "packed_neighbors") return read(value, packed_neighbors);
+      if (key == "neighbor_list_skin") return read(value, neighbor_list_skin);
+      if (key == "far_field_weight") return read(value, far_field_weight);
+      if (key == "far_field_theta") return read(value, far_field_theta);
+      if (key == "lod") return read(value, lod);
+      if (key == "analytics") return read(value, analytics);
+      if (key == "analytics_bins") return read(value, analytics_bins);
+      if (key == "species_bucketing") return read(value, species_bucketing);
+      if (key == "palette_colors") return read(value, palette_colors);
+      if (key == "tiled_rules") return read(value, tiled_rules);
+      if (key == "load_balancing") return read(value, load_balancing);
+    } else if (section == "output") {
+      if (key == "summary_every") return read(value, summary_every);
+      if (key == "stats") return read(value, stats_path);
+      if (key == "stats_every") return read(value, stats_every);
+      if (key == "positions") return read(value, positions_path);
+      if (key == "positions_every") return read(value, positions_every);
+      if (key == "live_export") return read(value, live_export);
+      if (key == "live_export_slots") return read(value, live_export_slots);
+    } else if (section.rfind("species.", 0) == 0) {
+      size_t s = std::stoul(section.substr(8));
+      if (s >= SpeciesTable::max_species) {
+        throw std::invalid_argument("too many species");
+      }
+      if (s >= species.size()) {
+        species.resize(s + 1);
+      }
+      SpeciesParameters &p = species[s].parameters;
+      if (key == "separation_radius") return read(value, p.separation_radius);
+      if (key == "alignment_radius") return read(value, p.alignment_radius);
+      if (key == "cohesion_radius") return read(value, p.cohesion_radius);
+      if (key == "separation_weight") return read(value, p.separation_weight);
+      if (key == "alignment_weight") return read(value, p.alignment_weight);
+      if (key == "cohesion_weight") return read(value, p.cohesion_weight);
+      if (key == "max_speed") return read(value, p.max_speed);
+      if (key == "share") return read(value, species[s].share);
+      if (key == "color") {
+        std::vector<float> c = numbers(value);
+        if (c.size() != 4) {
+          throw std::invalid_argument("color needs 4 components");
+        }
+        p.color = {static_cast<int>(c[0]), static_cast<int>(c[1]),
+                   static_cast<int>(c[2]), static_cast<int>(c[3])};
+        return;
+      }
+    }
+    throw std::invalid_argument("unknown key '" + key + "' in [" + section +
+                                "]");
+  }
+
+  static std::string trim(const std::string &s) {
+    const size_t beg = s.find_first_not_of(" \t\r");
+    if (beg == std::string::npos) {
+      return {};
+    }
+    return s.substr(beg, s.find_last_not_of(" \t\r") - beg + 1);
+  }
+
+  static std::string strip_comment(const std::string &s) {
+    bool quoted = false;
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] == '"') {
+        quoted = !quoted;
+      } else if (s[i] == '#' && !quoted) {
+        return s.substr(0, i);
+      }
+    }
+    return s;
+  }
+
+  /// all numbers of a possibly nested array, in order
+  static std::vector<float> numbers(const std::string &value) {
+    std::string flat = value;
+    std::replace_if(
+        flat.begin(), flat.end(),
+        [](char c) { return c == '[' || c == ']' || c == ','; }, ' ');
+    std::istringstream in(flat);
+    std::vector<float> result;
+    float x;
+    while (in >> x) {
+      result.push_back(x);
+    }
+    if (!in.eof()) {
+      throw std::invalid_argument("expected numbers, got '" + value + "'");
+    }
+    return result;
+  }
+
+  template <typename T> static void read(const std::string &value, T &out) {
+    std::istringstream in(value);
+    if (!(in >> out) || !(in >> std::ws).eof()) {
+      throw std::invalid_argument("invalid value '" + value + "'");
+    }
+  }
+
+  static void read(const std::string &value, bool &out) {
+    if (value != "true" && value != "false") {
+      throw std::invalid_argument("expected true or false, got '" + value +
+                                  "'");
+    }
+    out = value == "true";
+  }
+
+  static void read(const std::string &value, std::string &out) {
+    if (value.size() < 2 || value.front() != '"' || value.back() != '"') {
+      throw std::invalid_argument("expected a \"string\", got '" + value +
+                                  "'");
+    }
+    out = value.substr(1, value.size() - 2);
+  }
+
+  static void read(const std::string &value, Space2D &out) {
+    std::vector<float> v = numbers(value);
+    if (v.size() != 2) {
+      throw std::invalid_argument("expected [x, y], got '" + value + "'");
+    }
+    out = {v[0], v[1]};
+  }
+
+  static void read(const std::string &value, std::vector<Space2D> &out) {
+    std::vector<float> v = numbers(value);
+    if (v.size() % 2 != 0) {
+      throw std::invalid_argument("expected [[x, y], ...], got '" + value +
+                                  "'");
+    }
+    out.clear();
+    for (size_t i = 0; i < v.size(); i += 2) {
+      out.push_back({v[i], v[i + 1]});
+    }
+  }
+
+  template <typename E>
+  static E choose(const std::string &value,
+                  std::initializer_list<std::pair<const char *, E>> names) {
+    std::string name;
+    read(value, name);
+    for (const auto &[n, e] : names) {
+      if (name == n) {
+        return e;
+      }
+    }
+    throw std::invalid_argument("unknown value '" + name + "'");
+  }
+};
+
+/**
+ * Re-reads the scenario arguments (files and overrides, in the original
+ * order) whenever one of the files is written and publishes the species to
+ * the simulation, which takes them over before its next update. Runs on its
+ * own thread; a scenario that does not parse is skipped and reported by
+ * last_error().
+ */
+class ScenarioWatcher {
+public:
+  ScenarioWatcher(BoidsSimulation<Space2D> &simulation,
+                  std::vector<std::string> arguments,
+                  std::chrono::milliseconds interval =
+                      std::chrono::milliseconds(250))
+      : _simulation(simulation), _arguments(std::move(arguments)),
+        _interval(interval) {
+    for (const auto &arg : _arguments) {
+      if (arg.find('=') == std::string::npos) {
+        _files.push_back({arg, modified(arg)});
+      }
+    }
+    _thread = std::thread([this] { watch(); });
+  }
+
+  ~ScenarioWatcher() {
+    {
+      std::lock_guard lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+    _thread.join();
+  }
+
+  ScenarioWatcher(const ScenarioWatcher &) = delete;
+  ScenarioWatcher &operator=(const ScenarioWatcher &) = delete;
+
+  /// reloads published so far
+  [[nodiscard]] size_t reloads() const { return _reloads; }
+
+  [[nodiscard]] std::string last_error() const {
+    std::lock_guard lock(_mutex);
+    return _error;
+  }
+
+private:
+  struct File {
+    std::string path;
+    std::filesystem::file_time_type modified;
+  };
+
+  static std::filesystem::file_time_type modified(const std::string &path) {
+    std::error_code error;
+    return std::filesystem::last_write_time(path, error);
+  }
+
+  void watch() {
+    std::unique_lock lock(_mutex);
+    while (!_wake.wait_for(lock, _interval, [this] { return _stop; })) {
+      bool changed = false;
+      for (auto &file : _files) {
+        auto time = modified(file.path);
+        changed |= time != file.modified;
+        file.modified = time;
+      }
+      if (!changed) {
+        continue;
+      }
+      try {
+        Scenario scenario;
+        scenario.read_arguments(_arguments);
+        _simulation.publish_species(scenario.species_table());
+        ++_reloads;
+      } catch (const std::exception &e) {
+        _error = e.what();
+      }
+    }
+  }
+
+  BoidsSimulation<Space2D> &_simulation;
+  std::vector<std::string> _arguments;
+  std::chrono::milliseconds _interval;
+  std::vector<File> _files;
+  std::atomic<size_t> _reloads{0};
+  mutable std::mutex _mutex;
+  std::condition_variable _wake;
+  bool _stop{false};
+  std::string _error;
+  std::thread _thread;
+};
@@ -0,0 +1,151 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/thread_pool.h>
+
+struct CircleObstacle {
+  Space2D center;
+  float radius;
+};
+
+struct BoxObstacle {
+  Space2D min;
+  Space2D max;
+};
+
+template <Dimension S> class SignedDistanceField {};
+
+/**
+ * Signed distance to the union of all static obstacles, sampled on a regular
+ * raster over a Space. The raster is built in parallel once and reused until
+ * the obstacle set changes, so sampling is O(1) per boid no matter how many
+ * obstacles there are. Distances are negative inside obstacles.
+ */
+template <> class SignedDistanceField<Space2D> {
+public:
+  SignedDistanceField() = default;
+  SignedDistanceField(Space space, float texel_size)
+      : _space(space), _texel_size(texel_size),
+        _x_size(std::max<size_t>(2, space.width() / texel_size + 1)),
+        _y_size(std::max<size_t>(2, space.height() / texel_size + 1)) {}
+
+  void add(CircleObstacle obstacle) {
+    _circles.push_back(obstacle);
+    _dirty = true;
+  }
+
+  void add(BoxObstacle obstacle) {
+    _boxes.push_back(obstacle);
+    _dirty = true;
+  }
+
+  void clear() {
+    _circles.clear();
+    _boxes.clear();
+    _dirty = true;
+  }
+
+  [[nodiscard]] bool empty() const {
+    return _circles.empty() && _boxes.empty();
+  }
+
+  /// Rebuild the raster if the obstacles changed since the last build.
+  void build(BS::thread_pool &pool) {
+    if (!_dirty) {
+      return;
+    }
+    if (empty()) {
+      // nothing to sample, so do not keep the raster around
+      _distance = {};
+      _dirty = false;
+      return;
+    }
+    _distance.resize(_x_size * _y_size);
+    auto build_rows = [this](size_t beg, size_t end) {
+      for (size_t y = beg; y < end; ++y) {
+        for (size_t x = 0; x < _x_size; ++x) {
+          _distance[y * _x_size + x] =
+              exact({_space.position.x + x * _texel_size,
+                     _space.position.y + y * _texel_size});
+        }
+      }
+    };
+    pool.push_loop(_y_size, build_rows);
+    pool.wait_for_tasks();
+    _dirty = false;
+  }
+
+  /**
+   * Bilinearly interpolated distance at position and its gradient (pointing
+   * away from the nearest obstacle). Positions outside the raster are clamped
+   * to its border.
+   */
+  float sample(const Space2D &position, Space2D &gradient) const {
+    float fx = std::clamp((position.x - _space.position.x) / _texel_size, 0.f,
+                          static_cast<float>(_x_size - 1));
+    float fy = std::clamp((position.y - _space.position.y) / _texel_size, 0.f,
+                          static_cast<float>(_y_size - 1));
+    size_t x0 = std::min(static_cast<size_t>(fx), _x_size - 2);
+    size_t y0 = std::min(static_cast<size_t>(fy), _y_size - 2);
+    float tx = fx - x0;
+    float ty = fy - y0;
+
+    const float *row0 = _distance.data() + y0 * _x_size + x0;
+    const float *row1 = row0 + _x_size;
+    float d00 = row0[0], d10 = row0[1], d01 = row1[0], d11 = row1[1];
+
+    gradient.x = ((d10 - d00) * (1 - ty) + (d11 - d01) * ty) / _texel_size;
+    gradient.y = ((d01 - d00) * (1 - tx) + (d11 - d10) * tx) / _texel_size;
+    return (d00 * (1 - tx) + d10 * tx) * (1 - ty) +
+           (d01 * (1 - tx) + d11 * tx) * ty;
+  }
+
+  [[nodiscard]] size_t memory_usage() const {
+    return vector_bytes(_circles) + vector_bytes(_boxes) +
+           vector_bytes(_distance);
+  }
+
+private:
+  [[nodiscard]] float exact(const Space2D &p) const {
+    float d = std::numeric_limits<float>::max();
+    for (const auto &c : _circles) {
+      float dx = p.x - c.center.x;
+      float dy = p.y - c.center.y;
+      d = std::min(d, std::sqrt(dx * dx + dy * dy) - c.radius);
+    }
+    for (const auto &b : _boxes) {
+      float cx = (b.min.x + b.max.x) / 2;
+      float cy = (b.min.y + b.max.y) / 2;
+      float qx = std::abs(p.x - cx) - (b.max.x - b.min.x) / 2;
+      float qy = std::abs(p.y - cy) - (b.max.y - b.min.y) / 2;
+      float ox = std::max(qx, 0.f);
+      float oy = std::max(qy, 0.f);
+      d = std::min(d, std::sqrt(ox * ox + oy * oy) +
+                          std::min(std::max(qx, qy), 0.f));
+    }
+    return d;
+  }
+
+  Space _space{};
+  float _texel_size{1};
+  size_t _x_size{2};
+  size_t _y_size{2};
+
+  std::vector<CircleObstacle> _circles;
+  std::vector<BoxObstacle> _boxes;
+  std::vector<float> _distance;
+  bool _dirty{true};
+};
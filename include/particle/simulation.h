@@ -11,19 +11,180 @@
 #include <particle/types.h>
 #include <particle/grid.h>
 #include <particle/particle.h>
+#include <particle/random.h>
+#include <particle/snapshot.h>
+#include <particle/utils/async.h>
+#include <particle/utils/memory.h>
+#include <particle/utils/numa.h>
 #include <particle/utils/thread_pool.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define PARTICLE_LIVE_EXPORT
+#include <particle/live_export.h>
+#endif
+
 
 template <Dimension S> class Simulation {
 public:
   Simulation() = default;
-  Simulation(size_t num_particles, Grid<S> grid, uint num_threads = 0)
+  /**
+   * If pin_threads is set, the pool workers are pinned to CPUs node by node
+   * and each worker first-touches the partition of the particle arrays it
+   * processes in the per-particle phases, so its pages stay NUMA-local.
+   */
+  Simulation(size_t num_particles, Grid<S> grid, uint num_threads = 0,
+             bool pin_threads = false)
       : _particles(num_particles), _grid(grid),
-        _thread_pool(num_worker_threads(num_threads)) {}
+        _thread_pool(num_worker_threads(num_threads)) {
+    if (pin_threads) {
+      _workers.pin(_thread_pool, NumaTopology::detect());
+    }
+    first_touch();
+  }
+
+  virtual ~Simulation() { stop_async(); }
 
   virtual void draw(SDL_Renderer *renderer) = 0;
   virtual void update(Duration elapsed) = 0;
 
+  /**
+   * Run update(elapsed) on a separate thread and return immediately. Steps
+   * submitted back to back run in order. The particles must not be touched
+   * until the returned future is ready. A cancelled step stops at the next
+   * phase boundary and leaves the particles in a consistent state.
+   */
+  StepFuture update_async(Duration elapsed) {
+    return _driver.submit(
+        [this, elapsed](std::stop_token stop) {
+          _stop = std::move(stop);
+          _step_cancelled = false;
+          update(elapsed);
+          const bool completed = !_step_cancelled;
+          _stop = {};
+          _step_cancelled = false;
+          return completed;
+        },
+        _resume);
+  }
+
+  /// where coroutines awaiting update_async() are resumed, default: inline
+  void set_resume_executor(ResumeExecutor resume) {
+    _resume = std::move(resume);
+  }
+
+  /// cancel pending asynchronous steps and wait for the running one
+  void stop_async() { _driver.stop(); }
+
+  /**
+   * Spawn particles between updates. Spawned particles take part in the next
+   * update, despawned ones are removed at the end of it.
+   */
+  void spawn(size_t count, const S *positions, const S *velocities,
+             ParticleHandle *handles = nullptr,
+             const SpeciesId *species = nullptr) {
+    _particles.spawn(count, positions, velocities, handles, species);
+  }
+
+  ParticleHandle spawn(S position, S velocity, SpeciesId species = 0) {
+    return _particles.spawn(position, velocity, species);
+  }
+
+  bool despawn(ParticleHandle handle) { return _particles.despawn(handle); }
+
+  /**
+   * Remove despawned particles now instead of at the end of the next update,
+   * e.g. before spawning replacements. Returns the number removed.
+   */
+  size_t compact() { return _particles.compact(_thread_pool); }
+
+  /**
+   * Draw the positions and velocities of all live particles from the given
+   * distributions, in parallel over the same partitions as the update.
+   * Particle i gets the same values for the same seed, whatever the number
+   * of threads.
+   */
+  void randomize(const Distribution2D &position,
+                 const Distribution2D &velocity, uint64_t seed) {
+    const Philox4x32 rng(seed);
+    for_each_partition([&](size_t beg, size_t end) {
+      for (size_t i = beg; i < end; ++i) {
+        _particles.position_data()[i] = position.sample(rng(i, 0));
+        _particles.velocity_data()[i] = velocity.sample(rng(i, 1));
+      }
+    });
+  }
+
+  void set_border(BORDER border) { _border = border; }
+  [[nodiscard]] BORDER border() const { return _border; }
+
+  /// bounds the border rules are applied at
+  void set_space(Space space) { _space = space; }
+  [[nodiscard]] const Space &space() const { return _space; }
+
+  Particles<S> &particles() { return _particles; }
+  [[nodiscard]] const Particles<S> &particles() const { return _particles; }
+
+  Grid<S> &grid() { return _grid; }
+  [[nodiscard]] const Grid<S> &grid() const { return _grid; }
+
+  /// accumulated time and work per partition of the per-particle phases
+  [[nodiscard]] const std::vector<PartitionStats> &partition_stats() const {
+    return _partition_stats;
+  }
+  void reset_partition_stats() { _partition_stats.clear(); }
+
+  [[nodiscard]] const PinnedWorkers &workers() const { return _workers; }
+
+  [[nodiscard]] uint num_threads() const {
+    return _thread_pool.get_thread_count();
+  }
+
+  /**
+   * Publish a read-only version of the particle state after every step.
+   * Readers on other threads use snapshot() instead of particles(), which
+   * they must not touch while a step is running.
+   */
+  void set_snapshots(bool enabled) { _publish_snapshots = enabled; }
+
+  /// latest published version, safe to call from any thread
+  [[nodiscard]] Snapshot<S> snapshot() const { return _snapshots.latest(); }
+
+  [[nodiscard]] size_t skipped_snapshots() const {
+    return _snapshots.skipped();
+  }
+
+#ifdef PARTICLE_LIVE_EXPORT
+  /**
+   * Also write every step into the shared memory object name (see
+   * LiveExport), so visualizers in other processes can follow the
+   * simulation. The frames are written while the step touches the
+   * particles anyway. capacity 0 takes the current particle capacity; an
+   * empty name stops the export and removes the object.
+   */
+  void set_live_export(const std::string &name, size_t capacity = 0,
+                       size_t slots = 3) {
+    _live_export.reset();
+    if (!name.empty()) {
+      _live_export = std::make_unique<LiveExport<S>>(LiveExport<S>::create(
+          name, capacity > 0 ? capacity : _particles.capacity(), slots));
+    }
+  }
+
+  [[nodiscard]] const LiveExport<S> *live_export() const {
+    return _live_export.get();
+  }
+#endif
+
+  /// heap bytes per subsystem; divide the total by the particle count for
+  /// the footprint per particle
+  [[nodiscard]] virtual MemoryReport memory_report() const {
+    MemoryReport report;
+    report.add("particles", _particles.memory_usage());
+    report.add("grid", _grid.memory_usage());
+    report.add("snapshots", _snapshots.memory_usage());
+    return report;
+  }
+
 protected:
   static uint num_worker_threads(uint nt) {
     nt = nt > 0 ? nt : 1;
@@ -32,6 +193,72 @@ protected:
                : std::thread::hardware_concurrency();
   }
 
+  /**
+   * Loop over the live particle range with the same static partitioning that
+   * was used for first-touch. Blocks until the loop is done.
+   */
+  template <typename F> void for_each_partition(F &&loop) {
+    push_partitioned_loop(_thread_pool, _workers, _particles.size(),
+                          std::forward<F>(loop), &_partition_stats);
+    _thread_pool.wait_for_tasks();
+  }
+
+  /**
+   * True once the asynchronous step that is running was cancelled. Updates
+   * check this between phases and return early. Always false outside of
+   * asynchronous steps.
+   */
+  bool cancelled() {
+    if (!_stop.stop_possible()) {
+      return false;
+    }
+    if (_stop.stop_requested()) {
+      _step_cancelled = true;
+    }
+    return _step_cancelled;
+  }
+
+  /**
+   * Slot the current step writes its snapshot into while it touches the
+   * particles anyway, nullptr if snapshots are off or no slot is free.
+   */
+  SnapshotData<S> *begin_snapshot() {
+    _snapshot = _publish_snapshots
+                    ? _snapshots.begin(_particles.size(), _steps)
+                    : nullptr;
+#ifdef PARTICLE_LIVE_EXPORT
+    if (_live_export) {
+      _live_export->begin_frame(_steps, _particles.size());
+    }
+#endif
+    return _snapshot;
+  }
+
+  void end_snapshot() {
+    if (_snapshot != nullptr) {
+      _snapshots.publish();
+      _snapshot = nullptr;
+    }
+#ifdef PARTICLE_LIVE_EXPORT
+    if (_live_export) {
+      _live_export->end_frame();
+    }
+#endif
+    ++_steps;
+  }
+
+  void first_touch() {
+    auto touch = [this](size_t beg, size_t end) {
+      for (size_t i = beg; i < end; ++i) {
+        _particles.position_data()[i] = S{};
+        _particles.velocity_data()[i] = S{};
+        _particles.color_data()[i] = {255, 255, 255, 255};
+      }
+    };
+    push_partitioned_loop(_thread_pool, _workers, _particles.size(), touch);
+    _thread_pool.wait_for_tasks();
+  }
+
   Particles<S> _particles{};
   Space _space{0, 0, 100, 100};
   BORDER _border{BORDER::REFLECTIVE};
@@ -39,4 +266,19 @@ protected:
   Grid<S> _grid{};
 
   BS::thread_pool _thread_pool{std::thread::hardware_concurrency()};
+  PinnedWorkers _workers{};
+  std::vector<PartitionStats> _partition_stats;
+
+  SnapshotPublisher<S> _snapshots;
+  SnapshotData<S> *_snapshot{nullptr};
+  bool _publish_snapshots{false};
+#ifdef PARTICLE_LIVE_EXPORT
+  std::unique_ptr<LiveExport<S>> _live_export;
+#endif
+  uint64_t _steps{0};
+
+  AsyncDriver _driver;
+  ResumeExecutor _resume;
+  std::stop_token _stop;
+  bool _step_cancelled{false};
 };
\ No newline at end of file
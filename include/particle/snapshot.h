@@ -0,0 +1,188 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <particle/species.h>
+#include <particle/types.h>
+#include <particle/utils/memory.h>
+
+template <Dimension S> struct SnapshotData {
+  std::vector<S> position;
+  std::vector<S> velocity;
+  std::vector<cl_int4> color;
+  std::vector<SpeciesId> species;
+  /// predators as the particles of this version saw them, if any
+  std::vector<S> predator_position;
+  size_t size{0};
+  uint64_t step{0};
+
+  void resize(size_t n) {
+    position.resize(n);
+    velocity.resize(n);
+    color.resize(n);
+    species.resize(n);
+    size = n;
+  }
+};
+
+template <Dimension S> class SnapshotPublisher;
+
+/**
+ * Read-only view of one published version of the particle state. The version
+ * is not reused by the publisher while a Snapshot refers to it.
+ */
+template <Dimension S> class Snapshot {
+public:
+  Snapshot() = default;
+  Snapshot(Snapshot &&other) noexcept
+      : _data(std::exchange(other._data, nullptr)),
+        _readers(std::exchange(other._readers, nullptr)) {}
+  Snapshot &operator=(Snapshot &&other) noexcept {
+    if (this != &other) {
+      release();
+      _data = std::exchange(other._data, nullptr);
+      _readers = std::exchange(other._readers, nullptr);
+    }
+    return *this;
+  }
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+
+  ~Snapshot() { release(); }
+
+  explicit operator bool() const { return _data != nullptr; }
+
+  [[nodiscard]] size_t size() const { return _data->size; }
+  /// number of the step that produced this version
+  [[nodiscard]] uint64_t step() const { return _data->step; }
+  [[nodiscard]] const S *position_data() const {
+    return _data->position.data();
+  }
+  [[nodiscard]] const S *velocity_data() const {
+    return _data->velocity.data();
+  }
+  [[nodiscard]] const cl_int4 *color_data() const {
+    return _data->color.data();
+  }
+  [[nodiscard]] const SpeciesId *species_data() const {
+    return _data->species.data();
+  }
+  [[nodiscard]] size_t predators() const {
+    return _data->predator_position.size();
+  }
+  [[nodiscard]] const S *predator_position_data() const {
+    return _data->predator_position.data();
+  }
+
+private:
+  friend class SnapshotPublisher<S>;
+
+  Snapshot(const SnapshotData<S> *data, std::atomic<uint32_t> *readers)
+      : _data(data), _readers(readers) {}
+
+  void release() {
+    if (_readers != nullptr) {
+      _readers->fetch_sub(1, std::memory_order_release);
+      _data = nullptr;
+      _readers = nullptr;
+    }
+  }
+
+  const SnapshotData<S> *_data{nullptr};
+  std::atomic<uint32_t> *_readers{nullptr};
+};
+
+/**
+ * Single writer, any number of readers. The writer fills a slot that is
+ * neither current nor read by anyone and then makes it current with one
+ * atomic store; readers pin the current slot with a reader count and never
+ * wait for the writer. If readers hold on to every other slot, begin()
+ * returns nullptr and the version is skipped instead of stalling the writer.
+ */
+template <Dimension S> class SnapshotPublisher {
+public:
+  static constexpr uint32_t num_slots = 4;
+
+  /// slot for the next version, nullptr if none is free
+  SnapshotData<S> *begin(size_t size, uint64_t step) {
+    const uint32_t current = _current.load();
+    for (uint32_t s = 0; s < num_slots; ++s) {
+      if (s != current && _slots[s].readers.load() == 0) {
+        _writing = s;
+        _slots[s].data.resize(size);
+        _slots[s].data.step = step;
+        return &_slots[s].data;
+      }
+    }
+    _writing = none;
+    ++_skipped;
+    return nullptr;
+  }
+
+  /// make the slot returned by the last begin() the current version
+  void publish() {
+    if (_writing != none) {
+      _current.store(_writing);
+      _writing = none;
+    }
+  }
+
+  /**
+   * Pin the current version, an empty Snapshot if nothing was published yet.
+   * Only retries if a new version was published in between.
+   */
+  [[nodiscard]] Snapshot<S> latest() const {
+    while (true) {
+      const uint32_t current = _current.load();
+      if (current == none) {
+        return {};
+      }
+      Slot &slot = _slots[current];
+      slot.readers.fetch_add(1);
+      // the writer never touches the current slot, and a slot that stopped
+      // being current before we pinned it may already be rewritten
+      if (_current.load() == current) {
+        return {&slot.data, &slot.readers};
+      }
+      slot.readers.fetch_sub(1);
+    }
+  }
+
+  /// versions dropped because every slot was still being read
+  [[nodiscard]] size_t skipped() const { return _skipped; }
+
+  [[nodiscard]] size_t memory_usage() const {
+    size_t bytes = 0;
+    for (const Slot &slot : _slots) {
+      bytes += vector_bytes(slot.data.position) +
+               vector_bytes(slot.data.velocity) +
+               vector_bytes(slot.data.color) + vector_bytes(slot.data.species) +
+               vector_bytes(slot.data.predator_position);
+    }
+    return bytes;
+  }
+
+private:
+  static constexpr uint32_t none = ~uint32_t{0};
+
+  struct Slot {
+    SnapshotData<S> data;
+    alignas(64) std::atomic<uint32_t> readers{0};
+  };
+
+  mutable std::array<Slot, num_slots> _slots;
+  alignas(64) std::atomic<uint32_t> _current{none};
+  uint32_t _writing{none};
+  size_t _skipped{0};
+};
@@ -0,0 +1,126 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <particle/types.h>
+
+typedef uint8_t SpeciesId;
+
+struct SpeciesParameters {
+  float separation_radius{10};
+  float alignment_radius{30};
+  float cohesion_radius{30};
+  float separation_weight{1};
+  float alignment_weight{1};
+  float cohesion_weight{1};
+  float max_speed{100};
+  cl_int4 color{255, 255, 255, 255};
+};
+
+/**
+ * Per-species rule parameters plus an interaction matrix stored as one bit
+ * mask per species: bit j of mask(i) is set if species i reacts to species j.
+ * interacts() is a shift and a mask, so the rule loops can weight neighbors
+ * with it instead of branching.
+ */
+class SpeciesTable {
+public:
+  static constexpr size_t max_species = 32;
+
+  SpeciesTable() { add({}); }
+
+  /// adds a species that interacts with every species; returns its id
+  SpeciesId add(const SpeciesParameters &parameters) {
+    if (_parameters.size() == max_species) {
+      throw std::length_error("SpeciesTable: too many species");
+    }
+    _parameters.push_back(parameters);
+    _mask.push_back(~uint32_t{0});
+    return static_cast<SpeciesId>(_parameters.size() - 1);
+  }
+
+  void set_interaction(SpeciesId species, SpeciesId other, bool interacts) {
+    if (interacts) {
+      _mask[species] |= uint32_t{1} << other;
+    } else {
+      _mask[species] &= ~(uint32_t{1} << other);
+    }
+  }
+
+  SpeciesParameters &operator[](SpeciesId species) {
+    return _parameters[species];
+  }
+  const SpeciesParameters &operator[](SpeciesId species) const {
+    return _parameters[species];
+  }
+
+  [[nodiscard]] uint32_t mask(SpeciesId species) const {
+    return _mask[species] & ((uint64_t{1} << _parameters.size()) - 1);
+  }
+
+  /// 1 if species reacts to other, 0 otherwise
+  [[nodiscard]] float interacts(SpeciesId species, SpeciesId other) const {
+    return static_cast<float>((_mask[species] >> other) & 1u);
+  }
+
+  /// largest radius of any rule of any species
+  [[nodiscard]] float max_radius() const {
+    float r = 0;
+    for (const auto &p : _parameters) {
+      r = std::max({r, p.separation_radius, p.alignment_radius,
+                    p.cohesion_radius});
+    }
+    return r;
+  }
+
+  /**
+   * Smallest radius of any rule of any species, infinity if there is none.
+   * A radius of 0 disables its rule and is not counted.
+   */
+  [[nodiscard]] float min_radius() const {
+    float r = std::numeric_limits<float>::infinity();
+    for (const auto &p : _parameters) {
+      for (float radius :
+           {p.separation_radius, p.alignment_radius, p.cohesion_radius}) {
+        if (radius > 0) {
+          r = std::min(r, radius);
+        }
+      }
+    }
+    return r;
+  }
+
+  [[nodiscard]] float max_speed() const {
+    float v = 0;
+    for (const auto &p : _parameters) {
+      v = std::max(v, p.max_speed);
+    }
+    return v;
+  }
+
+  [[nodiscard]] bool unit_weights() const {
+    return std::all_of(_parameters.begin(), _parameters.end(),
+                       [](const SpeciesParameters &p) {
+                         return p.separation_weight == 1 &&
+                                p.alignment_weight == 1 &&
+                                p.cohesion_weight == 1;
+                       });
+  }
+
+  [[nodiscard]] size_t size() const { return _parameters.size(); }
+
+private:
+  std::vector<SpeciesParameters> _parameters;
+  std::vector<uint32_t> _mask;
+};
@@ -9,10 +9,14 @@
 
 #include <chrono>
 #include <concepts>
+#include <cstdint>
 #include <missocl/opencl.h>
 
 typedef std::chrono::duration<double> Duration;
 
+/// index of a particle in a particle set, stored in grids and lists
+typedef uint32_t ParticleIndex;
+
 typedef cl_float2 Space2D;
 typedef cl_float3 Space3D;
 
@@ -30,10 +34,12 @@ enum class ENGINE { CPU, OPENCL };
 
 enum class BORDER { REFLECTIVE, TOROIDAL, RESET };
 
+enum class INTEGRATOR { EULER, SEMI_IMPLICIT_EULER, VELOCITY_VERLET };
+
 struct Space {
   cl_int2 position;
   cl_int2 size;
 
-  [[nodiscard]] size_t height() const { return size.x; }
-  [[nodiscard]] size_t width() const { return size.y; }
+  [[nodiscard]] size_t width() const { return size.x; }
+  [[nodiscard]] size_t height() const { return size.y; }
 };
@@ -0,0 +1,184 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <utility>
+
+/// hands a suspended coroutine back to the host, e.g. posts it to its loop
+using ResumeExecutor = std::function<void(std::coroutine_handle<>)>;
+
+struct AsyncStepState {
+  std::mutex mutex;
+  std::condition_variable done_cv;
+  bool done{false};
+  bool completed{false};
+  std::stop_source stop;
+  std::coroutine_handle<> waiter;
+  ResumeExecutor resume;
+};
+
+/**
+ * Result of an asynchronous step. Can be polled, waited on or co_awaited;
+ * the result is true if the step ran to the end and false if it was
+ * cancelled.
+ */
+class StepFuture {
+public:
+  StepFuture() = default;
+  explicit StepFuture(std::shared_ptr<AsyncStepState> state)
+      : _state(std::move(state)) {}
+
+  [[nodiscard]] bool valid() const { return _state != nullptr; }
+
+  [[nodiscard]] bool ready() const {
+    std::lock_guard lock(_state->mutex);
+    return _state->done;
+  }
+
+  void wait() const {
+    std::unique_lock lock(_state->mutex);
+    _state->done_cv.wait(lock, [this] { return _state->done; });
+  }
+
+  bool get() const {
+    wait();
+    return _state->completed;
+  }
+
+  /**
+   * Ask the step to stop at the next phase boundary. A step that has not
+   * started yet does not run at all.
+   */
+  void cancel() { _state->stop.request_stop(); }
+
+  [[nodiscard]] bool await_ready() const { return ready(); }
+
+  /// resumed through the executor if one was given, else on the step thread
+  bool await_suspend(std::coroutine_handle<> waiter) {
+    std::lock_guard lock(_state->mutex);
+    if (_state->done) {
+      return false;
+    }
+    _state->waiter = waiter;
+    return true;
+  }
+
+  bool await_resume() const { return get(); }
+
+private:
+  std::shared_ptr<AsyncStepState> _state;
+};
+
+/**
+ * Runs submitted jobs one after another on its own thread, so the submitting
+ * thread never blocks. A job gets the stop token of its step and returns
+ * whether it ran to the end.
+ */
+class AsyncDriver {
+public:
+  using Job = std::function<bool(std::stop_token)>;
+
+  AsyncDriver() = default;
+  AsyncDriver(const AsyncDriver &) = delete;
+  AsyncDriver &operator=(const AsyncDriver &) = delete;
+
+  ~AsyncDriver() { stop(); }
+
+  StepFuture submit(Job job, ResumeExecutor resume = {}) {
+    auto state = std::make_shared<AsyncStepState>();
+    state->resume = std::move(resume);
+    {
+      std::lock_guard lock(_mutex);
+      if (!_thread.joinable()) {
+        _thread = std::jthread([this](std::stop_token stop) { run(stop); });
+      }
+      _queue.emplace_back(std::move(job), state);
+    }
+    _queue_cv.notify_one();
+    return StepFuture(state);
+  }
+
+  /// cancels the running and all queued jobs and waits for the thread
+  void stop() {
+    std::jthread thread;
+    {
+      std::lock_guard lock(_mutex);
+      if (!_thread.joinable()) {
+        return;
+      }
+      if (_running != nullptr) {
+        _running->stop.request_stop();
+      }
+      // under the lock, so the thread takes no job submitted from now on
+      _thread.request_stop();
+      thread = std::move(_thread);
+    }
+    thread.join();
+  }
+
+private:
+  void run(std::stop_token stop) {
+    while (true) {
+      std::pair<Job, std::shared_ptr<AsyncStepState>> next;
+      {
+        std::unique_lock lock(_mutex);
+        _queue_cv.wait(lock, stop, [this] { return !_queue.empty(); });
+        if (stop.stop_requested()) {
+          for (auto &[job, state] : _queue) {
+            finish(*state, false);
+          }
+          _queue.clear();
+          return;
+        }
+        next = std::move(_queue.front());
+        _queue.pop_front();
+        _running = next.second;
+      }
+      auto &[job, state] = next;
+      bool completed =
+          !state->stop.stop_requested() && job(state->stop.get_token());
+      {
+        std::lock_guard lock(_mutex);
+        _running = nullptr;
+      }
+      finish(*state, completed);
+    }
+  }
+
+  static void finish(AsyncStepState &state, bool completed) {
+    std::coroutine_handle<> waiter;
+    {
+      std::lock_guard lock(state.mutex);
+      state.done = true;
+      state.completed = completed;
+      waiter = std::exchange(state.waiter, {});
+    }
+    state.done_cv.notify_all();
+    if (waiter) {
+      if (state.resume) {
+        state.resume(waiter);
+      } else {
+        waiter.resume();
+      }
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable_any _queue_cv;
+  std::deque<std::pair<Job, std::shared_ptr<AsyncStepState>>> _queue;
+  std::shared_ptr<AsyncStepState> _running;
+  std::jthread _thread;
+};
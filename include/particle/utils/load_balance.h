@@ -0,0 +1,89 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include <particle/utils/thread_pool.h>
+
+/// run [beg, end) of some work items with its estimated and measured cost
+struct WorkChunk {
+  size_t beg{0};
+  size_t end{0};
+  double cost{0};
+  double seconds{0};
+};
+
+/**
+ * Cut items 0..n into at most chunks runs of about equal estimated cost.
+ * prefix has n + 1 entries, prefix[i] is the summed cost of the items before
+ * i. A single item more expensive than its share gets a run of its own.
+ */
+inline std::vector<WorkChunk> balanced_chunks(const std::vector<double> &prefix,
+                                              size_t chunks) {
+  std::vector<WorkChunk> result;
+  const size_t n = prefix.empty() ? 0 : prefix.size() - 1;
+  if (n == 0 || chunks == 0) {
+    return result;
+  }
+  const double total = prefix.back() - prefix.front();
+  size_t beg = 0;
+  for (size_t c = 1; c <= chunks && beg < n; ++c) {
+    size_t end = n;
+    if (c < chunks) {
+      const double target =
+          prefix.front() + total * static_cast<double>(c) / chunks;
+      end = static_cast<size_t>(
+          std::lower_bound(prefix.begin() + beg + 1, prefix.end(), target) -
+          prefix.begin());
+      end = std::clamp(end, beg + 1, n);
+    }
+    result.push_back({beg, end, prefix[end] - prefix[beg]});
+    beg = end;
+  }
+  return result;
+}
+
+/// items 0..n in chunks runs of equal length, each costing its length
+inline std::vector<WorkChunk> even_chunks(size_t n, size_t chunks) {
+  std::vector<WorkChunk> result;
+  BS::blocks blks(size_t{0}, n, chunks);
+  for (size_t b = 0; n > 0 && b < blks.get_num_blocks(); ++b) {
+    result.push_back({blks.start(b), blks.end(b),
+                      static_cast<double>(blks.end(b) - blks.start(b))});
+  }
+  return result;
+}
+
+/**
+ * f(beg, end) for every chunk on the pool, most expensive first, and wait.
+ * The pool queue is FIFO, so the big chunks start first and the small ones
+ * fill up the workers that finish early (longest processing time first).
+ * The seconds of every chunk are stored in it.
+ */
+template <typename F>
+void run_largest_first(BS::thread_pool &pool, std::vector<WorkChunk> &chunks,
+                       F &&f) {
+  std::stable_sort(chunks.begin(), chunks.end(),
+                   [](const WorkChunk &a, const WorkChunk &b) {
+                     return a.cost > b.cost;
+                   });
+  for (WorkChunk &chunk : chunks) {
+    pool.push_task([&f, &chunk] {
+      auto start = std::chrono::steady_clock::now();
+      f(chunk.beg, chunk.end);
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      chunk.seconds = elapsed.count();
+    });
+  }
+  pool.wait_for_tasks();
+}
@@ -0,0 +1,52 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/// heap bytes reserved by a vector, including the element storage of nested vectors
+template <typename T> size_t vector_bytes(const std::vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+
+template <typename T>
+size_t vector_bytes(const std::vector<std::vector<T>> &v) {
+  size_t bytes = v.capacity() * sizeof(std::vector<T>);
+  for (const auto &inner : v) {
+    bytes += vector_bytes(inner);
+  }
+  return bytes;
+}
+
+/// heap bytes held per subsystem, collected by Simulation::memory_report()
+class MemoryReport {
+public:
+  struct Entry {
+    std::string name;
+    size_t bytes;
+  };
+
+  void add(std::string name, size_t bytes) {
+    _entries.push_back({std::move(name), bytes});
+  }
+
+  [[nodiscard]] const std::vector<Entry> &entries() const { return _entries; }
+
+  [[nodiscard]] size_t total() const {
+    size_t bytes = 0;
+    for (const auto &entry : _entries) {
+      bytes += entry.bytes;
+    }
+    return bytes;
+  }
+
+private:
+  std::vector<Entry> _entries;
+};
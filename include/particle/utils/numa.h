@@ -0,0 +1,202 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <particle/utils/thread_pool.h>
+
+/**
+ * CPUs of the host grouped by NUMA node. On non-Linux hosts or if sysfs is not
+ * available, all hardware threads are reported on a single node.
+ */
+class NumaTopology {
+public:
+  static NumaTopology detect() {
+    NumaTopology topology;
+#ifdef __linux__
+    namespace fs = std::filesystem;
+    const fs::path nodes("/sys/devices/system/node");
+    std::error_code ec;
+    for (int node = 0; fs::exists(nodes / ("node" + std::to_string(node)), ec);
+         ++node) {
+      std::ifstream cpulist(nodes / ("node" + std::to_string(node)) /
+                            "cpulist");
+      std::string list;
+      std::getline(cpulist, list);
+      for (int cpu : parse_cpulist(list)) {
+        topology._cpus.push_back(cpu);
+        topology._node.push_back(node);
+      }
+      topology._num_nodes = node + 1;
+    }
+#endif
+    if (topology._cpus.empty()) {
+      for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu) {
+        topology._cpus.push_back(static_cast<int>(cpu));
+        topology._node.push_back(0);
+      }
+      topology._num_nodes = 1;
+    }
+    return topology;
+  }
+
+  /// all CPUs, ordered node by node
+  [[nodiscard]] const std::vector<int> &cpus() const { return _cpus; }
+  /// NUMA node of cpus()[i]
+  [[nodiscard]] int node(size_t i) const { return _node[i]; }
+  [[nodiscard]] size_t num_nodes() const { return _num_nodes; }
+
+private:
+  // parses lists like "0-3,8-11"
+  static std::vector<int> parse_cpulist(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+      if (range.empty()) {
+        continue;
+      }
+      auto dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+
+  std::vector<int> _cpus;
+  std::vector<int> _node;
+  size_t _num_nodes{1};
+};
+
+inline bool pin_current_thread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+/**
+ * Pins the workers of a BS::thread_pool to CPUs (filling one NUMA node after
+ * the other) and gives each worker a stable id. Worker w prefers partition w
+ * of a partitioned loop, so the range it first-touched stays node-local.
+ */
+class PinnedWorkers {
+public:
+  void pin(BS::thread_pool &pool, const NumaTopology &topology) {
+    const size_t n = pool.get_thread_count();
+    _node.assign(n, 0);
+    std::atomic<int> next{0};
+    // every worker has to arrive before any can leave, so each of the n tasks
+    // runs on a different worker
+    std::barrier sync(static_cast<std::ptrdiff_t>(n));
+    for (size_t i = 0; i < n; ++i) {
+      pool.push_task([&] {
+        const int worker = next.fetch_add(1);
+        const size_t c = worker % topology.cpus().size();
+        pin_current_thread(topology.cpus()[c]);
+        _node[worker] = topology.node(c);
+        _current_worker = worker;
+        sync.arrive_and_wait();
+      });
+    }
+    pool.wait_for_tasks();
+    _num_nodes = topology.num_nodes();
+  }
+
+  /// id of the calling worker, -1 if called from an unpinned thread
+  static int current_worker() { return _current_worker; }
+
+  [[nodiscard]] int node_of_worker(int worker) const {
+    return worker >= 0 && worker < static_cast<int>(_node.size())
+               ? _node[worker]
+               : 0;
+  }
+
+  [[nodiscard]] bool pinned() const { return !_node.empty(); }
+  [[nodiscard]] size_t num_nodes() const { return _num_nodes; }
+
+private:
+  static inline thread_local int _current_worker = -1;
+
+  std::vector<int> _node;
+  size_t _num_nodes{1};
+};
+
+struct PartitionStats {
+  size_t processed{0};
+  double seconds{0};
+  int node{0};
+};
+
+/**
+ * Split [0, size) into one partition per worker and push one task per
+ * partition. A task first claims the partition of its own worker and falls
+ * back to any unclaimed one, so each partition runs exactly once. Like
+ * push_loop(), the caller has to wait_for_tasks().
+ */
+template <typename F>
+void push_partitioned_loop(BS::thread_pool &pool, const PinnedWorkers &workers,
+                           size_t size, F &&loop,
+                           std::vector<PartitionStats> *stats = nullptr) {
+  if (size == 0) {
+    return;
+  }
+  BS::blocks blks(size_t{0}, size, pool.get_thread_count());
+  const size_t n = blks.get_num_blocks();
+  auto claimed = std::make_shared<std::vector<std::atomic_flag>>(n);
+  auto body = std::make_shared<std::decay_t<F>>(std::forward<F>(loop));
+  if (stats != nullptr && stats->size() < n) {
+    stats->resize(n);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    pool.push_task([&workers, body, blks, n, claimed, stats] {
+      const int worker = PinnedWorkers::current_worker();
+      size_t part = static_cast<size_t>(worker);
+      if (worker < 0 || part >= n || (*claimed)[part].test_and_set()) {
+        part = 0;
+        while ((*claimed)[part].test_and_set()) {
+          ++part;
+        }
+      }
+      auto start = std::chrono::steady_clock::now();
+      (*body)(blks.start(part), blks.end(part));
+      if (stats != nullptr) {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        auto &s = (*stats)[part];
+        s.processed += blks.end(part) - blks.start(part);
+        s.seconds += elapsed.count();
+        s.node = workers.node_of_worker(worker);
+      }
+    });
+  }
+}
@@ -0,0 +1,232 @@
+/**
+ * Copyright 2023, Leon Freist (https://github.com/lfreist)
+ * Author: Leon Freist <freist.leon@gmail.com>
+ *
+ * This file is part of kiss-ocl.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * POSIX shared memory object mapped into this process. The creating side
+ * unlinks the name again when it is destroyed.
+ */
+class SharedMemory {
+public:
+  SharedMemory() = default;
+
+  static SharedMemory create(const std::string &name, size_t size) {
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("shm_open(" + name +
+                               "): " + std::strerror(errno));
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      int err = errno;
+      close(fd);
+      shm_unlink(name.c_str());
+      throw std::runtime_error("ftruncate(" + name +
+                               "): " + std::strerror(err));
+    }
+    SharedMemory shm(name, fd, size, true);
+    return shm;
+  }
+
+  /**
+   * Attach to an existing object. Waits up to timeout for the creator to set
+   * it up, so processes may be started in any order.
+   */
+  static SharedMemory open(const std::string &name,
+                           std::chrono::milliseconds timeout =
+                               std::chrono::milliseconds(5000)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      int fd = shm_open(name.c_str(), O_RDWR, 0600);
+      if (fd >= 0) {
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+          return {name, fd, static_cast<size_t>(st.st_size), false};
+        }
+        close(fd);
+      } else if (errno != ENOENT) {
+        throw std::runtime_error("shm_open(" + name +
+                                 "): " + std::strerror(errno));
+      }
+      if (std::chrono::steady_clock::now() > deadline) {
+        throw std::runtime_error("shm_open(" + name + "): timed out");
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  SharedMemory(SharedMemory &&other) noexcept { swap(other); }
+  SharedMemory &operator=(SharedMemory &&other) noexcept {
+    if (this != &other) {
+      SharedMemory tmp(std::move(other));
+      swap(tmp);
+    }
+    return *this;
+  }
+  SharedMemory(const SharedMemory &) = delete;
+  SharedMemory &operator=(const SharedMemory &) = delete;
+
+  ~SharedMemory() {
+    if (_data != nullptr) {
+      munmap(_data, _size);
+    }
+    if (_owner) {
+      shm_unlink(_name.c_str());
+    }
+  }
+
+  void swap(SharedMemory &other) noexcept {
+    std::swap(_name, other._name);
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+    std::swap(_owner, other._owner);
+  }
+
+  [[nodiscard]] void *data() const { return _data; }
+  [[nodiscard]] size_t size() const { return _size; }
+  [[nodiscard]] const std::string &name() const { return _name; }
+
+private:
+  SharedMemory(std::string name, int fd, size_t size, bool owner)
+      : _name(std::move(name)), _size(size), _owner(owner) {
+    _data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (_data == MAP_FAILED) {
+      _data = nullptr;
+      if (_owner) {
+        shm_unlink(_name.c_str());
+      }
+      throw std::runtime_error("mmap(" + _name + "): " + std::strerror(errno));
+    }
+  }
+
+  std::string _name;
+  void *_data{nullptr};
+  size_t _size{0};
+  bool _owner{false};
+};
+
+/**
+ * An object is visible to open() as soon as it has a size, before its
+ * creator wrote anything into it. So the creator stores a ready word in it
+ * last (release) and readers look at nothing else before they saw it
+ * (acquire). The word is 0 until then, the memory starts zero-filled.
+ */
+inline void mark_ready(uint32_t &word, uint32_t value) {
+  std::atomic_ref<uint32_t>(word).store(value, std::memory_order_release);
+}
+
+/// false if word is not value by deadline
+inline bool wait_ready(uint32_t &word, uint32_t value,
+                       std::chrono::steady_clock::time_point deadline) {
+  while (std::atomic_ref<uint32_t>(word).load(std::memory_order_acquire) !=
+         value) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+/**
+ * Single-producer single-consumer ring of trivially copyable records living in
+ * shared memory. Producer and consumer may be different processes.
+ */
+template <typename T> class ShmRing {
+  static_assert(std::is_trivially_copyable_v<T>);
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+  static constexpr uint32_t magic = 0x474e4952; // "RING"
+
+  struct Header {
+    uint32_t ready;
+    uint64_t capacity;
+    alignas(64) std::atomic<uint64_t> head; // next slot to write
+    alignas(64) std::atomic<uint64_t> tail; // next slot to read
+  };
+
+public:
+  ShmRing() = default;
+
+  /// capacity is rounded up to a power of two
+  static ShmRing create(const std::string &name, size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity) {
+      cap <<= 1;
+    }
+    ShmRing ring(SharedMemory::create(name, sizeof(Header) + cap * sizeof(T)));
+    ring._header->capacity = cap;
+    new (&ring._header->head) std::atomic<uint64_t>(0);
+    new (&ring._header->tail) std::atomic<uint64_t>(0);
+    mark_ready(ring._header->ready, magic);
+    return ring;
+  }
+
+  /// waits up to timeout for the creator to create and initialize it
+  static ShmRing open(const std::string &name,
+                      std::chrono::milliseconds timeout =
+                          std::chrono::milliseconds(5000)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    ShmRing ring(SharedMemory::open(name, timeout));
+    if (ring._shm.size() < sizeof(Header) ||
+        !wait_ready(ring._header->ready, magic, deadline)) {
+      throw std::runtime_error("ShmRing: '" + name + "' is not a ring");
+    }
+    return ring;
+  }
+
+  bool try_push(const T &record) {
+    const uint64_t head = _header->head.load(std::memory_order_relaxed);
+    if (head - _header->tail.load(std::memory_order_acquire) ==
+        _header->capacity) {
+      return false;
+    }
+    _records[head & (_header->capacity - 1)] = record;
+    _header->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T &record) {
+    const uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+    if (tail == _header->head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    record = _records[tail & (_header->capacity - 1)];
+    _header->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  [[nodiscard]] size_t capacity() const { return _header->capacity; }
+
+private:
+  explicit ShmRing(SharedMemory shm)
+      : _shm(std::move(shm)), _header(static_cast<Header *>(_shm.data())),
+        _records(reinterpret_cast<T *>(static_cast<char *>(_shm.data()) +
+                                       sizeof(Header))) {}
+
+  SharedMemory _shm;
+  Header *_header{nullptr};
+  T *_records{nullptr};
+};